@@ -0,0 +1,13 @@
+#!/bin/bash
+echoExec() {
+    echo $*
+    $*
+}
+echoExec cd $(cd $(dirname ${BASH_SOURCE[0]})/.. && pwd)
+
+if [ -f bin/batch ]; then
+    echoExec ./bin/batch --engine=static/FaceDetectorBatch.engine \
+        --input=static/images \
+        --output=output/result.jsonl \
+        --batch=8 --threads=4
+fi
@@ -0,0 +1,25 @@
+#!/bin/bash
+echoExec() {
+    echo $*
+    $*
+}
+echoExec cd $(cd $(dirname ${BASH_SOURCE[0]})/.. && pwd)
+
+if [ -f bin/batch ]; then
+    echoExec mkdir -p output/benchmark
+    for mode in resize slide cascade; do
+        echoExec rm -f output/benchmark/$mode.jsonl
+        echoExec ./bin/batch --engine=static/FaceDetectorBatch.engine \
+            --input=static/images \
+            --output=output/benchmark/$mode.jsonl \
+            --mode=$mode --batch=8 --threads=4
+    done
+    for maxWindows in 0 4 16; do
+        echoExec rm -f output/benchmark/cascade_$maxWindows.jsonl
+        echoExec ./bin/batch --engine=static/FaceDetectorBatch.engine \
+            --input=static/images \
+            --output=output/benchmark/cascade_$maxWindows.jsonl \
+            --mode=cascade --cascade_max_windows=$maxWindows \
+            --batch=8 --threads=4
+    done
+fi
@@ -6,5 +6,5 @@ echoExec() {
 echoExec cd $(cd $(dirname ${BASH_SOURCE[0]})/.. && pwd)
 
 if [ -f bin/server ]; then
-    echoExec ./bin/server localhost:50051 static/FaceDetector.engine
+    echoExec ./bin/server localhost:50051 static/FaceDetector.engine /tmp/face-grpc.sock
 fi
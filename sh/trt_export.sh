@@ -5,8 +5,25 @@ echoExec() {
 }
 echoExec cd $(cd $(dirname ${BASH_SOURCE[0]})/.. && pwd)
 
+# ./sh/trt_export.sh fp16: FP16 layers and FP16 outputs (bbox, score, landmark)
+OUTPUT_FORMAT=""
+if [ "$1" == "fp16" ]; then
+    OUTPUT_FORMAT="--fp16 --outputIOFormats=fp16:chw,fp16:chw,fp16:chw"
+fi
+
+# Kernels are tuned for --optShapes, the server infers batch 1
 echoExec trtexec --onnx=static/FaceDetector.onnx \
     --minShapes=input:1x3x640x640 \
     --optShapes=input:1x3x640x640 \
     --maxShapes=input:1x3x640x640 \
+    $OUTPUT_FORMAT \
     --saveEngine=static/FaceDetector.engine
+
+# bin/batch infers chunks of --engine_batch windows, the last one may be
+# smaller
+echoExec trtexec --onnx=static/FaceDetector.onnx \
+    --minShapes=input:1x3x640x640 \
+    --optShapes=input:8x3x640x640 \
+    --maxShapes=input:8x3x640x640 \
+    $OUTPUT_FORMAT \
+    --saveEngine=static/FaceDetectorBatch.engine
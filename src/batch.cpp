@@ -0,0 +1,527 @@
+#include <cstdint>
+#include <cstdio>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <absl/flags/flag.h>
+#include <absl/flags/parse.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include "engine.hpp"
+#include "utils.hpp"
+
+ABSL_FLAG(std::string, engine, "static/FaceDetectorBatch.engine",
+          "Path to TensorRT engine file");
+ABSL_FLAG(std::string, input, "",
+          "Image directory, or text file with one image path per line");
+ABSL_FLAG(std::string, output, "output/result.jsonl",
+          "Output file, resumed if it already exists");
+ABSL_FLAG(std::string, format, "jsonl", "Output format, jsonl or binary");
+ABSL_FLAG(std::string, mode, "slide",
+          "Face detection mode, resize, slide or cascade");
+ABSL_FLAG(int, batch, 8, "Number of images inferred together");
+ABSL_FLAG(int, engine_batch, 8,
+          "Batch size to run the TensorRT engine file with, windows are "
+          "inferred in chunks of this size, at most the max batch of "
+          "sh/trt_export.sh");
+ABSL_FLAG(std::string, output_scale, "",
+          "Quantization scales of INT8 engine outputs, required for INT8 "
+          "outputs, e.g. bbox=0.01,score=0.004,landmark=0.02");
+ABSL_FLAG(int, threads, 4, "Number of image decoding threads");
+ABSL_FLAG(double, nms_threshold, .1, "Non-maximum suppression threshold");
+ABSL_FLAG(double, score_threshold, .9, "Confidence score threshold");
+ABSL_FLAG(double, cascade_candidate_threshold,
+          FaceCascadeOptions().candidateThreshold,
+          "Minimum score of a first pass candidate in cascade mode");
+ABSL_FLAG(double, cascade_small_face, FaceCascadeOptions().smallFaceSize,
+          "First pass faces smaller than this size are refined in cascade "
+          "mode");
+ABSL_FLAG(int, cascade_max_windows, FaceCascadeOptions().maxWindows,
+          "Maximum number of sliding windows per image in cascade mode, "
+          "0 for no limit");
+
+/**
+ * @class BlockingQueue
+ * @brief Bounded multi-producer multi-consumer queue
+ */
+template <typename T> class BlockingQueue {
+public:
+  explicit BlockingQueue(std::size_t capacity)
+      : capacity(capacity), closed(false) {}
+
+  void push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [this] { return items.size() < capacity; });
+    items.push_back(std::move(item));
+    notEmpty.notify_one();
+  }
+
+  /**
+   * @brief Pop one item, wait until available
+   * @return
+   * false if queue is closed and drained
+   */
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+    if (items.empty()) {
+      return false;
+    }
+    item = std::move(items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    notEmpty.notify_all();
+  }
+
+private:
+  std::size_t capacity;
+  bool closed;
+  std::deque<T> items;
+  std::mutex mutex;
+  std::condition_variable notFull;
+  std::condition_variable notEmpty;
+};
+
+struct DecodedImage {
+  std::string path;
+  cv::Mat image;
+};
+
+/**
+ * @brief Detection record of one image,
+ * width and height are 0 if image can not be decoded
+ */
+struct Record {
+  std::string path;
+  int width;
+  int height;
+  /**
+   * @brief 15 values per face, bbox(x, y, width, height), score,
+   * landmark(x0, y0, ..., x4, y4), normalized to image size
+   */
+  std::vector<float> faces;
+};
+
+static const int RECORD_FACE_SIZE = 15;
+
+std::vector<std::string> listImages(const std::string &input) {
+  static const std::unordered_set<std::string> EXTENSIONS = {
+      ".jpg", ".jpeg", ".png", ".bmp", ".tif", ".tiff", ".webp"};
+  std::vector<std::string> paths;
+  if (std::filesystem::is_directory(input)) {
+    for (auto &entry :
+         std::filesystem::recursive_directory_iterator(input)) {
+      if (!entry.is_regular_file()) {
+        continue;
+      }
+      auto extension = entry.path().extension().string();
+      std::transform(extension.begin(), extension.end(), extension.begin(),
+                     [](unsigned char c) { return std::tolower(c); });
+      if (EXTENSIONS.count(extension)) {
+        paths.push_back(entry.path().string());
+      }
+    }
+    std::sort(paths.begin(), paths.end());
+  } else {
+    std::ifstream listFile(input);
+    std::string line;
+    while (std::getline(listFile, line)) {
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      if (!line.empty()) {
+        paths.push_back(line);
+      }
+    }
+  }
+  return paths;
+}
+
+void appendJsonString(std::string &json, const std::string &str) {
+  json += '"';
+  for (unsigned char c : str) {
+    if (c == '"' || c == '\\') {
+      json += '\\';
+      json += c;
+    } else if (c < 0x20) {
+      char escaped[8];
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      json += escaped;
+    } else {
+      json += c;
+    }
+  }
+  json += '"';
+}
+
+/**
+ * @brief Parse path of a complete JSONL record written by writeJsonl
+ * @return
+ * false if line is not a record
+ */
+bool parseJsonlPath(const std::string &line, std::string &path) {
+  static const std::string PREFIX = "{\"path\":\"";
+  if (line.compare(0, PREFIX.size(), PREFIX)) {
+    return false;
+  }
+  path.clear();
+  for (std::size_t i = PREFIX.size(); i < line.size(); i++) {
+    char c = line[i];
+    if (c == '"') {
+      return true;
+    }
+    if (c == '\\' && i + 1 < line.size()) {
+      c = line[++i];
+      if (c == 'u' && i + 4 < line.size()) {
+        path += (char)std::stoi(line.substr(i + 1, 4), nullptr, 16);
+        i += 4;
+        continue;
+      }
+    }
+    path += c;
+  }
+  return false;
+}
+
+void writeJsonl(std::ofstream &output, const Record &record) {
+  static thread_local std::string json;
+  json.clear();
+  json += "{\"path\":";
+  appendJsonString(json, record.path);
+  if (!record.width) {
+    json += ",\"error\":\"decode failed\"}\n";
+    output << json;
+    return;
+  }
+  char number[128];
+  std::snprintf(number, sizeof(number), ",\"width\":%d,\"height\":%d",
+                record.width, record.height);
+  json += number;
+  json += ",\"faces\":[";
+  for (std::size_t i = 0; i < record.faces.size(); i += RECORD_FACE_SIZE) {
+    const float *face = record.faces.data() + i;
+    json += i ? ",{" : "{";
+    std::snprintf(number, sizeof(number), "\"bbox\":[%.6f,%.6f,%.6f,%.6f]",
+                  face[0], face[1], face[2], face[3]);
+    json += number;
+    std::snprintf(number, sizeof(number), ",\"score\":%.6f", face[4]);
+    json += number;
+    json += ",\"landmark\":[";
+    for (int j = 0; j < 10; j++) {
+      std::snprintf(number, sizeof(number), j ? ",%.6f" : "%.6f",
+                    face[5 + j]);
+      json += number;
+    }
+    json += "]}";
+  }
+  json += "]}\n";
+  output << json;
+}
+
+/**
+ * @brief Binary record layout (native byte order):
+ * uint32 path size, path, int32 width, int32 height, uint32 face count,
+ * float[RECORD_FACE_SIZE] per face
+ */
+void writeBinary(std::ofstream &output, const Record &record) {
+  std::uint32_t pathSize = record.path.size();
+  std::int32_t width = record.width, height = record.height;
+  std::uint32_t faceCount = record.faces.size() / RECORD_FACE_SIZE;
+  output.write((const char *)&pathSize, sizeof(pathSize));
+  output.write(record.path.data(), pathSize);
+  output.write((const char *)&width, sizeof(width));
+  output.write((const char *)&height, sizeof(height));
+  output.write((const char *)&faceCount, sizeof(faceCount));
+  output.write((const char *)record.faces.data(),
+               record.faces.size() * sizeof(float));
+}
+
+/**
+ * @brief Read paths of complete records in existing output,
+ * trailing incomplete record left by interruption is truncated
+ */
+std::unordered_set<std::string> resumeOutput(const std::string &outputPath,
+                                             bool binary) {
+  std::unordered_set<std::string> done;
+  if (!std::filesystem::exists(outputPath)) {
+    return done;
+  }
+  std::ifstream output(outputPath, std::ios::binary);
+  std::uint64_t validSize = 0;
+  if (binary) {
+    std::uint32_t pathSize, faceCount;
+    std::int32_t size[2];
+    std::string path;
+    while (output.read((char *)&pathSize, sizeof(pathSize))) {
+      path.resize(pathSize);
+      if (!output.read(&path[0], pathSize) ||
+          !output.read((char *)size, sizeof(size)) ||
+          !output.read((char *)&faceCount, sizeof(faceCount))) {
+        break;
+      }
+      std::streamsize facesSize =
+          (std::streamsize)faceCount * RECORD_FACE_SIZE * sizeof(float);
+      if (!output.ignore(facesSize) || output.gcount() != facesSize) {
+        break;
+      }
+      validSize = output.tellg();
+      done.insert(path);
+    }
+  } else {
+    std::string line, path;
+    while (std::getline(output, line)) {
+      if (output.eof()) {
+        break;
+      }
+      validSize += line.size() + 1;
+      if (parseJsonlPath(line, path)) {
+        done.insert(path);
+      }
+    }
+  }
+  output.close();
+  if (validSize != std::filesystem::file_size(outputPath)) {
+    std::filesystem::resize_file(outputPath, validSize);
+  }
+  return done;
+}
+
+int main(int argc, char **argv) {
+  absl::ParseCommandLine(argc, argv);
+  auto outputPath = absl::GetFlag(FLAGS_output);
+  auto format = absl::GetFlag(FLAGS_format);
+  auto modeName = absl::GetFlag(FLAGS_mode);
+  int batch = std::max(absl::GetFlag(FLAGS_batch), 1);
+  int threads = std::max(absl::GetFlag(FLAGS_threads), 1);
+  float nmsThreshold = absl::GetFlag(FLAGS_nms_threshold);
+  float scoreThreshold = absl::GetFlag(FLAGS_score_threshold);
+  FaceCascadeOptions cascade;
+  cascade.candidateThreshold = absl::GetFlag(FLAGS_cascade_candidate_threshold);
+  cascade.smallFaceSize = absl::GetFlag(FLAGS_cascade_small_face);
+  cascade.maxWindows = absl::GetFlag(FLAGS_cascade_max_windows);
+  if (format != "jsonl" && format != "binary") {
+    std::cerr << "Unknown output format " << format << std::endl;
+    return 1;
+  }
+  bool binary = format == "binary";
+  FaceDetectionMode mode;
+  if (modeName == "resize") {
+    mode = FaceDetectionMode::RESIZE;
+  } else if (modeName == "slide") {
+    mode = FaceDetectionMode::SLIDE;
+  } else if (modeName == "cascade") {
+    mode = FaceDetectionMode::CASCADE;
+  } else {
+    std::cerr << "Unknown face detection mode " << modeName << std::endl;
+    return 1;
+  }
+  std::unordered_map<std::string, float> outputScale;
+  try {
+    outputScale = parseOutputScale(absl::GetFlag(FLAGS_output_scale));
+  } catch (const std::exception &error) {
+    std::cerr << error.what() << std::endl;
+    return 1;
+  }
+
+  auto paths = listImages(absl::GetFlag(FLAGS_input));
+  auto done = resumeOutput(outputPath, binary);
+  std::vector<std::string> pending;
+  for (auto &path : paths) {
+    if (!done.count(path)) {
+      pending.push_back(path);
+    }
+  }
+  std::cout << "Found " << paths.size() << " images, " << done.size()
+            << " already processed, " << pending.size() << " to process"
+            << std::endl;
+  if (pending.empty()) {
+    return 0;
+  }
+  auto outputDir = std::filesystem::path(outputPath).parent_path();
+  if (!outputDir.empty()) {
+    std::filesystem::create_directories(outputDir);
+  }
+  std::unique_ptr<InferEngine> engine;
+  try {
+    engine.reset(createFaceDetector(
+        absl::GetFlag(FLAGS_engine), absl::GetFlag(FLAGS_engine_batch),
+        nvinfer1::ILogger::Severity::kWARNING, outputScale));
+  } catch (const std::exception &error) {
+    std::cerr << error.what() << std::endl;
+    return 1;
+  }
+  std::ofstream output(outputPath, std::ios::binary | std::ios::app);
+  if (!output) {
+    std::cerr << "Failed to open " << outputPath << std::endl;
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  BlockingQueue<DecodedImage> decodedQueue(batch * 4);
+  BlockingQueue<std::vector<Record>> recordQueue(4);
+
+  std::atomic<std::size_t> nextIndex(0);
+  std::atomic<int> runningDecoders(threads);
+  std::vector<std::thread> decoders;
+  for (int i = 0; i < threads; i++) {
+    decoders.emplace_back([&] {
+      std::size_t index;
+      while ((index = nextIndex++) < pending.size()) {
+        decodedQueue.push(
+            {pending[index], cv::imread(pending[index], cv::IMREAD_COLOR)});
+      }
+      if (--runningDecoders == 0) {
+        decodedQueue.close();
+      }
+    });
+  }
+
+  std::uint64_t processed = 0;
+  std::atomic<bool> writeFailed(false);
+  std::thread writer([&] {
+    std::vector<Record> records;
+    auto lastReport = start;
+    while (recordQueue.pop(records)) {
+      if (writeFailed) {
+        // Keep draining so the detection loop never blocks on a full queue
+        continue;
+      }
+      for (auto &record : records) {
+        if (binary) {
+          writeBinary(output, record);
+        } else {
+          writeJsonl(output, record);
+        }
+      }
+      output.flush();
+      if (!output) {
+        writeFailed = true;
+        continue;
+      }
+      processed += records.size();
+      auto now = std::chrono::steady_clock::now();
+      if (now - lastReport >= std::chrono::seconds(5)) {
+        double seconds = std::chrono::duration<double>(now - start).count();
+        std::cout << "Processed " << processed << "/" << pending.size()
+                  << " images, " << processed / seconds << " images/s"
+                  << std::endl;
+        lastReport = now;
+      }
+    }
+  });
+
+  FaceDetectionWorkspace workspace;
+  std::vector<cv::Mat> images;
+  std::vector<std::string> imagePaths;
+  std::uint64_t decodedImages = 0;
+  std::uint64_t windows = 0;
+  std::uint64_t faces = 0;
+  std::uint64_t batches = 0;
+  double detectSeconds = 0.;
+  bool more = true;
+  while (more) {
+    std::vector<Record> records;
+    images.clear();
+    imagePaths.clear();
+    DecodedImage decoded;
+    if (writeFailed) {
+      // Stop decoding and drain images already decoded
+      nextIndex = pending.size();
+      while (decodedQueue.pop(decoded)) {
+      }
+      break;
+    }
+    while (images.size() < (std::size_t)batch &&
+           (more = decodedQueue.pop(decoded))) {
+      if (decoded.image.empty()) {
+        records.push_back({std::move(decoded.path), 0, 0, {}});
+        continue;
+      }
+      images.push_back(std::move(decoded.image));
+      imagePaths.push_back(std::move(decoded.path));
+    }
+    if (!images.empty()) {
+      auto detectStart = std::chrono::steady_clock::now();
+      auto &results =
+          faceDetection(engine.get(), images, workspace, mode, nmsThreshold,
+                        scoreThreshold, 1000, 100, cascade);
+      detectSeconds += std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - detectStart)
+                           .count();
+      batches++;
+      decodedImages += images.size();
+      windows += workspace.lastWindows;
+      for (std::size_t k = 0; k < images.size(); k++) {
+        auto &result = results[k];
+        Record record = {std::move(imagePaths[k]), images[k].cols,
+                         images[k].rows, {}};
+        record.faces.reserve(result.bbox.size() * RECORD_FACE_SIZE);
+        faces += result.bbox.size();
+        for (std::size_t i = 0; i < result.bbox.size(); i++) {
+          auto &bboxItem = result.bbox[i];
+          record.faces.push_back(bboxItem.x);
+          record.faces.push_back(bboxItem.y);
+          record.faces.push_back(bboxItem.width);
+          record.faces.push_back(bboxItem.height);
+          record.faces.push_back(result.score[i]);
+          for (int j = 0; j < 5; j++) {
+            record.faces.push_back(result.landmark[i].at<double>(j, 0));
+            record.faces.push_back(result.landmark[i].at<double>(j, 1));
+          }
+        }
+        records.push_back(std::move(record));
+      }
+    }
+    if (!records.empty()) {
+      recordQueue.push(std::move(records));
+    }
+  }
+  recordQueue.close();
+  writer.join();
+  for (auto &decoder : decoders) {
+    decoder.join();
+  }
+
+  if (writeFailed) {
+    std::cerr << "Failed to write " << outputPath << " after " << processed
+              << " images" << std::endl;
+    return 1;
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(end - start).count();
+  // Images that failed to decode have records but no windows or faces
+  std::cout << "Processed " << processed << " images ("
+            << processed - decodedImages << " unreadable) in " << seconds
+            << "s, " << processed / seconds << " images/s, "
+            << (double)windows / std::max<std::uint64_t>(decodedImages, 1)
+            << " windows/image, "
+            << (double)faces / std::max<std::uint64_t>(decodedImages, 1)
+            << " faces/image, "
+            << detectSeconds * 1000. / std::max<std::uint64_t>(batches, 1)
+            << "ms/batch detection" << std::endl;
+  return 0;
+}
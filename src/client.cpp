@@ -1,4 +1,6 @@
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
 
 #include <chrono>
 #include <fstream>
@@ -14,6 +16,8 @@
 
 #include "service.grpc.pb.h"
 
+#include "shm.hpp"
+
 int main(int argc, char **argv) {
   auto stub = FaceDetectionService::NewStub(
       grpc::CreateChannel(argv[1], grpc::InsecureChannelCredentials()));
@@ -22,11 +26,55 @@ int main(int argc, char **argv) {
   std::ifstream imageFile(argv[2], std::ios::binary);
   std::stringstream buffer;
   buffer << imageFile.rdbuf();
-  request.set_image(buffer.str());
+  // "shm" writes the encoded image, "shm-raw" the decoded BGR frame into
+  // shared memory, only the slot handle is sent through gRPC,
+  // the ring is registered over the server's unix socket side channel
+  std::string transport = argc > 4 ? argv[4] : "";
+  std::string sharedMemoryPath = argc > 5 ? argv[5] : "/tmp/face-grpc.sock";
+  std::unique_ptr<SharedMemoryClient> sharedMemory;
+  if (transport == "shm" || transport == "shm-raw") {
+    auto imageData = buffer.str();
+    cv::Mat frame;
+    std::uint64_t size = imageData.size();
+    if (transport == "shm-raw") {
+      frame = cv::imread(argv[2]);
+      size = frame.total() * frame.elemSize();
+    }
+    try {
+      sharedMemory.reset(new SharedMemoryClient(sharedMemoryPath, 4, size));
+    } catch (const std::exception &error) {
+      std::cerr << "Shared memory failed: " << error.what() << std::endl;
+      return 1;
+    }
+    auto &ring = sharedMemory->getRing();
+    int index = ring.acquire();
+    if (index < 0) {
+      std::cerr << "Shared memory failed: no free slot" << std::endl;
+      return 1;
+    }
+    auto slot = request.mutable_slot();
+    slot->set_token(sharedMemory->getToken());
+    slot->set_index(index);
+    slot->set_size(size);
+    if (transport == "shm-raw") {
+      cv::Mat slotFrame(frame.rows, frame.cols, CV_8UC3, ring.getSlot(index));
+      frame.copyTo(slotFrame);
+      slot->set_width(frame.cols);
+      slot->set_height(frame.rows);
+    } else {
+      std::memcpy(ring.getSlot(index), imageData.data(), size);
+    }
+  } else {
+    request.set_image(buffer.str());
+  }
   FaceDetectionResponse response;
   auto start = std::chrono::steady_clock::now();
-  stub->serve(&context, request, &response);
+  auto status = stub->serve(&context, request, &response);
   auto end = std::chrono::steady_clock::now();
+  if (!status.ok()) {
+    std::cerr << "Serve failed: " << status.error_message() << std::endl;
+    return 1;
+  }
   std::cout << "Inference used "
             << std::chrono::duration<double, std::milli>(end - start).count()
             << "ms, detected " << response.bbox_size() << " faces" << std::endl;
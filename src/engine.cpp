@@ -215,6 +215,8 @@ InferEngine::InferEngine(
   }
 }
 
+InferEngine::InferEngine(int batchSize) : batchSize(batchSize) {}
+
 InferEngine::~InferEngine() {
   context.reset();
   engine.reset();
@@ -222,46 +224,115 @@ InferEngine::~InferEngine() {
   allocator.reset();
 }
 
-inline nvinfer1::DataType
+nvinfer1::DataType
 InferEngine::getTensorDataType(const std::string &name) {
   return engine->getTensorDataType(name.c_str());
 }
 
+void InferEngine::setTensorScale(const std::string &name, float scale) {
+  tensorScale[name] = scale;
+}
+
+float InferEngine::getTensorScale(const std::string &name) const {
+  auto it = tensorScale.find(name);
+  return it == tensorScale.end() ? 1.F : it->second;
+}
+
+InferWorkspace::InferWorkspace() : stream(nullptr), slot(0), allocations(0) {}
+
+InferWorkspace::~InferWorkspace() {
+  if (stream) {
+    cudaStreamDestroy(stream);
+  }
+  for (auto &slotBuffer : outputBuffer) {
+    for (auto &nameBuffer : slotBuffer) {
+      cudaFreeHost(nameBuffer.second.addr);
+    }
+  }
+}
+
 std::unordered_map<std::string, cv::Mat>
 InferEngine::infer(const std::unordered_map<std::string, cv::Mat> &input) {
+  InferWorkspace workspace;
   std::unordered_map<std::string, cv::Mat> output;
+  // Outputs of workspace are pinned buffers freed with workspace
+  for (auto &nameMat : infer(input, workspace)) {
+    output[nameMat.first] = nameMat.second.clone();
+  }
+  return output;
+}
+
+const std::unordered_map<std::string, cv::Mat> &
+InferEngine::infer(const std::unordered_map<std::string, cv::Mat> &input,
+                   InferWorkspace &workspace) {
+  enqueue(input, workspace);
+  return wait(workspace);
+}
+
+void InferEngine::enqueue(
+    const std::unordered_map<std::string, cv::Mat> &input,
+    InferWorkspace &workspace) {
   int totalBatchSize = input.begin()->second.size[0];
   int epochs = std::ceil((double)totalBatchSize / batchSize);
-  cudaStream_t stream;
-  cudaStreamCreate(&stream);
+  if (!workspace.stream) {
+    cudaStreamCreate(&workspace.stream);
+  }
+  cudaStream_t stream = workspace.stream;
+  // Outputs of the previous enqueue stay readable while this one runs
+  workspace.slot ^= 1;
+  auto &output = workspace.output[workspace.slot];
+  for (auto &nameBuffer : outputBuffer) {
+    auto &name = nameBuffer.first;
+    auto &buffer = nameBuffer.second;
+    auto &hostBuffer = workspace.outputBuffer[workspace.slot][name];
+    auto &outputItem = output[name];
+    int depth = getCvDepth(getTensorDataType(name));
+    std::size_t size = totalBatchSize * buffer.size;
+    if (hostBuffer.size < size) {
+      if (hostBuffer.addr) {
+        cudaFreeHost(hostBuffer.addr);
+      }
+      // Pinned memory, device to host copies do not block the host
+      cudaHostAlloc(&hostBuffer.addr, size, cudaHostAllocDefault);
+      hostBuffer.size = size;
+      workspace.allocations++;
+    }
+    if (outputItem.data != hostBuffer.addr || outputItem.depth() != depth ||
+        outputItem.size[0] != totalBatchSize) {
+      int sizes[nvinfer1::Dims::MAX_DIMS + 1];
+      sizes[0] = totalBatchSize;
+      auto sizesIt = sizes + 1;
+      for (int sizeItem : buffer.sizes) {
+        *sizesIt++ = sizeItem;
+      }
+      outputItem = cv::Mat((int)buffer.sizes.size() + 1, sizes, depth,
+                           hostBuffer.addr);
+      workspace.allocations++;
+    }
+  }
   for (int epoch = 0; epoch < epochs; epoch++) {
     int curBatchSize = std::min(batchSize, totalBatchSize - epoch * batchSize);
     for (auto &nameMat : input) {
       auto &name = nameMat.first;
       auto &buffer = inputBuffer[name];
-      cudaMemcpy(buffer.addr,
-                 input.at(name).data + epoch * batchSize * buffer.size,
-                 curBatchSize * buffer.size, cudaMemcpyHostToDevice);
+      cudaMemcpyAsync(buffer.addr,
+                      input.at(name).data + epoch * batchSize * buffer.size,
+                      curBatchSize * buffer.size, cudaMemcpyHostToDevice,
+                      stream);
     }
     context->enqueueV3(stream);
     for (auto &nameBuffer : outputBuffer) {
       auto &name = nameBuffer.first;
       auto &buffer = nameBuffer.second;
-      if (output.find(name) == output.end()) {
-        std::vector<int> sizes(buffer.sizes.size() + 1);
-        sizes[0] = totalBatchSize;
-        auto sizesIt = sizes.begin() + 1;
-        for (int sizeItem : buffer.sizes) {
-          *sizesIt++ = sizeItem;
-        }
-        output[name] = cv::Mat(sizes, getCvDepth(getTensorDataType(name)));
-      }
-      cudaMemcpy(output[name].data + epoch * batchSize * buffer.size,
-                 buffer.addr, curBatchSize * buffer.size,
-                 cudaMemcpyDeviceToHost);
+      cudaMemcpyAsync(output[name].data + epoch * batchSize * buffer.size,
+                      buffer.addr, curBatchSize * buffer.size,
+                      cudaMemcpyDeviceToHost, stream);
     }
   }
-  cudaStreamSynchronize(stream);
-  cudaStreamDestroy(stream);
-  return output;
+}
+
+const std::unordered_map<std::string, cv::Mat> &
+InferEngine::wait(InferWorkspace &workspace) {
+  cudaStreamSynchronize(workspace.stream);
+  return workspace.output[workspace.slot];
 }
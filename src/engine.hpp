@@ -10,8 +10,52 @@
 #include <vector>
 
 #include <NvInfer.h>
+#include <cuda_runtime_api.h>
 #include <opencv2/core.hpp>
 
+/**
+ * @class InferWorkspace
+ * @brief Reusable pinned host output buffers and CUDA stream for InferEngine,
+ * outputs are double buffered to be read while the next input is inferred,
+ * buffers grow to the largest batch seen and are reused afterwards,
+ * do not share one workspace between threads
+ */
+class InferWorkspace {
+public:
+  /**
+   * @brief Constructor
+   */
+  InferWorkspace();
+  /**
+   * @brief Destructor
+   */
+  ~InferWorkspace();
+  InferWorkspace(const InferWorkspace &) = delete;
+  InferWorkspace &operator=(const InferWorkspace &) = delete;
+
+  /**
+   * @brief Get number of output buffer (re)allocations made by this workspace
+   * @return
+   * Total number of output buffer (re)allocations,
+   * stays unchanged for steady-state requests
+   */
+  std::uint64_t getAllocations() const { return allocations; }
+
+private:
+  friend class InferEngine;
+
+  struct HostBuffer {
+    void *addr;
+    std::size_t size;
+  };
+
+  cudaStream_t stream;
+  int slot;
+  std::uint64_t allocations;
+  std::unordered_map<std::string, HostBuffer> outputBuffer[2];
+  std::unordered_map<std::string, cv::Mat> output[2];
+};
+
 /**
  * @class InferEngine
  * @brief TensorRT inference engine
@@ -47,7 +91,12 @@ public:
   /**
    * @brief Destructor
    */
-  ~InferEngine();
+  virtual ~InferEngine();
+
+  /**
+   * @brief Get supported batch size by TensorRT engine file
+   */
+  int getBatchSize() const { return batchSize; }
 
   /**
    * @brief Get tensor data type by name
@@ -57,7 +106,26 @@ public:
    * Tensor data type,
    * refer to nvinfer1::DataType
    */
-  inline nvinfer1::DataType getTensorDataType(const std::string &name);
+  nvinfer1::DataType getTensorDataType(const std::string &name);
+
+  /**
+   * @brief Set quantization scale of tensor by name
+   * @param name
+   * Tensor name
+   * @param scale
+   * Quantization scale for INT8 tensor,
+   * real value = quantized value * scale
+   */
+  void setTensorScale(const std::string &name, float scale);
+
+  /**
+   * @brief Get quantization scale of tensor by name
+   * @param name
+   * Tensor name
+   * @return
+   * Quantization scale set by setTensorScale, 1 if not set
+   */
+  float getTensorScale(const std::string &name) const;
 
   /**
    * @brief Inference input data
@@ -65,12 +133,63 @@ public:
    * Input name and data,
    * e.g. std::unordered_map{{"input", cv::Mat(size: 1 x 3 x 100 x 100)}}
    * @return
-   * Output name and data,
+   * Output name and data, owned by the returned Mats,
    * e.g. std::unordered_map{{"bbox", cv::Mat(size: 1 x 100 x 4)}}
    */
   std::unordered_map<std::string, cv::Mat>
   infer(const std::unordered_map<std::string, cv::Mat> &input);
 
+  /**
+   * @brief Inference input data with reusable workspace,
+   * same as enqueue followed by wait
+   * @param input
+   * Input name and data,
+   * e.g. std::unordered_map{{"input", cv::Mat(size: 1 x 3 x 100 x 100)}}
+   * @param workspace
+   * Workspace holding output buffers and CUDA stream
+   * @return
+   * Output name and data stored in workspace,
+   * valid until the second next inference with the same workspace,
+   * e.g. std::unordered_map{{"bbox", cv::Mat(size: 1 x 100 x 4)}}
+   */
+  const std::unordered_map<std::string, cv::Mat> &
+  infer(const std::unordered_map<std::string, cv::Mat> &input,
+        InferWorkspace &workspace);
+
+  /**
+   * @brief Start inference of input data without waiting for outputs,
+   * wait must be called before the next enqueue with the same workspace
+   * @param input
+   * Input name and data, must stay unchanged until wait returns,
+   * e.g. std::unordered_map{{"input", cv::Mat(size: 1 x 3 x 100 x 100)}}
+   * @param workspace
+   * Workspace holding output buffers and CUDA stream
+   */
+  virtual void enqueue(const std::unordered_map<std::string, cv::Mat> &input,
+                       InferWorkspace &workspace);
+
+  /**
+   * @brief Wait for inference started by enqueue
+   * @param workspace
+   * Workspace passed to enqueue
+   * @return
+   * Output name and data stored in workspace,
+   * valid until the second next enqueue with the same workspace,
+   * i.e. readable while the next input is inferred,
+   * e.g. std::unordered_map{{"bbox", cv::Mat(size: 1 x 100 x 4)}}
+   */
+  virtual const std::unordered_map<std::string, cv::Mat> &
+  wait(InferWorkspace &workspace);
+
+protected:
+  /**
+   * @brief Constructor without TensorRT engine,
+   * for engines overriding enqueue and wait, e.g. synthetic outputs in tests
+   * @param batchSize
+   * Supported batch size
+   */
+  explicit InferEngine(int batchSize);
+
 private:
   struct BufferInfo {
     void *addr;
@@ -88,6 +207,7 @@ private:
 
   std::unordered_map<std::string, BufferInfo> inputBuffer;
   std::unordered_map<std::string, BufferInfo> outputBuffer;
+  std::unordered_map<std::string, float> tensorScale;
 };
 
 #endif
@@ -1,30 +1,282 @@
+#include <algorithm>
 #include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include <google/protobuf/arena.h>
 #include <grpcpp/grpcpp.h>
+#include <opencv2/core.hpp>
 #include <opencv2/imgcodecs.hpp>
 
 #include "service.grpc.pb.h"
 
 #include "engine.hpp"
+#include "shm.hpp"
 #include "utils.hpp"
 
-class FaceDetectionServiceImpl final : public FaceDetectionService::Service {
+/**
+ * @class ArenaMessageAllocator
+ * @brief Allocate request and response of each call on a protobuf arena,
+ * all messages of the call are freed at once when the call finishes,
+ * contents of bytes fields (e.g. the image) are still heap allocated
+ * by std::string in protobuf 3.21, freed with the arena
+ */
+class ArenaMessageAllocator
+    : public grpc::MessageAllocator<FaceDetectionRequest,
+                                    FaceDetectionResponse> {
 public:
-  explicit FaceDetectionServiceImpl(const std::string &engineFilePath)
-      : engine(createFaceDetector(engineFilePath)) {}
+  grpc::MessageHolder<FaceDetectionRequest, FaceDetectionResponse> *
+  AllocateMessages() override {
+    return new ArenaMessageHolder();
+  }
+
+private:
+  class ArenaMessageHolder
+      : public grpc::MessageHolder<FaceDetectionRequest,
+                                   FaceDetectionResponse> {
+  public:
+    ArenaMessageHolder() : arena(getArenaOptions()) {
+      set_request(
+          google::protobuf::Arena::Create<FaceDetectionRequest>(&arena));
+      set_response(
+          google::protobuf::Arena::Create<FaceDetectionResponse>(&arena));
+    }
+    void Release() override { delete this; }
+
+  private:
+    google::protobuf::Arena arena;
+
+    static google::protobuf::ArenaOptions getArenaOptions() {
+      google::protobuf::ArenaOptions options;
+      options.start_block_size = 1 << 12;
+      options.max_block_size = 1 << 20;
+      return options;
+    }
+  };
+};
+
+/**
+ * @class SlotReleaser
+ * @brief Release a shared memory slot when leaving scope
+ */
+class SlotReleaser {
+public:
+  SlotReleaser(std::shared_ptr<SharedMemoryRing> ring, std::uint32_t slot)
+      : ring(std::move(ring)), slot(slot) {}
+  ~SlotReleaser() {
+    if (ring) {
+      ring->release(slot);
+    }
+  }
+  SlotReleaser(const SlotReleaser &) = delete;
+  SlotReleaser &operator=(const SlotReleaser &) = delete;
+
+private:
+  std::shared_ptr<SharedMemoryRing> ring;
+  std::uint32_t slot;
+};
+
+/**
+ * @class WorkerPool
+ * @brief Fixed number of threads running submitted tasks in order,
+ * at most maxPending tasks wait for a thread,
+ * pending tasks are finished before destruction
+ */
+class WorkerPool {
+public:
+  WorkerPool(int threadCount, std::size_t maxPending)
+      : maxPending(maxPending) {
+    for (int i = 0; i < threadCount; i++) {
+      threads.emplace_back([this] { run(); });
+    }
+  }
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    condition.notify_all();
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  /**
+   * @return
+   * false if maxPending tasks are already waiting, task is not run
+   */
+  bool submit(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (tasks.size() >= maxPending) {
+        return false;
+      }
+      tasks.push_back(std::move(task));
+    }
+    condition.notify_one();
+    return true;
+  }
+
+private:
+  std::size_t maxPending;
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::deque<std::function<void()>> tasks;
+  bool stopping = false;
+  std::vector<std::thread> threads;
+
+  void run() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+        if (tasks.empty()) {
+          return;
+        }
+        task = std::move(tasks.front());
+        tasks.pop_front();
+      }
+      task();
+    }
+  }
+};
+
+class FaceDetectionServiceImpl final
+    : public FaceDetectionService::CallbackService {
+public:
+  static const int MAX_CROP_SIZE = 512;
+  // Raw size of all crops of a request, below the 4 MiB default
+  // receive limit of gRPC clients, also bounds the per-thread crop buffer
+  static const std::uint64_t MAX_CROP_BYTES = 3840 << 10;
+  // Detection is serialized by engineMutex, the other workers decode and
+  // encode crops meanwhile
+  static const int WORKER_COUNT = 4;
+  // Each waiting call keeps its request (up to the 4 MiB default receive
+  // limit) alive, calls beyond this are rejected with RESOURCE_EXHAUSTED
+  static const int MAX_PENDING = 32;
+
+  FaceDetectionServiceImpl(
+      const std::string &engineFilePath, const std::string &sharedMemoryPath,
+      const std::unordered_map<std::string, float> &outputScale)
+      : engine(createFaceDetector(engineFilePath, 1,
+                                  nvinfer1::ILogger::Severity::kWARNING,
+                                  outputScale)),
+        sharedMemory(sharedMemoryPath.empty()
+                         ? nullptr
+                         : new SharedMemoryServer(sharedMemoryPath)),
+        workers(std::max(1U, std::min(std::thread::hardware_concurrency(),
+                                      (unsigned)WORKER_COUNT)),
+                MAX_PENDING) {
+    SetMessageAllocatorFor_serve(&allocator);
+  }
+
+  grpc::ServerUnaryReactor *serve(grpc::CallbackServerContext *context,
+                                  const FaceDetectionRequest *request,
+                                  FaceDetectionResponse *response) override {
+    auto reactor = context->DefaultReactor();
+    // Decoding, inference and crop encoding block,
+    // run them on workers instead of the gRPC callback threads
+    bool submitted = workers.submit([this, request, response, reactor] {
+      grpc::Status status;
+      try {
+        status = detect(request, response);
+      } catch (const std::exception &error) {
+        status = grpc::Status(grpc::StatusCode::INTERNAL, error.what());
+      }
+      reactor->Finish(status);
+    });
+    if (!submitted) {
+      reactor->Finish(grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                                   "Too many pending requests"));
+    }
+    return reactor;
+  }
+
+private:
+  ArenaMessageAllocator allocator;
+  std::unique_ptr<InferEngine> engine;
+  // Guards the execution context and device buffers of engine, and
+  // workspace, only one detection can run at a time
+  std::mutex engineMutex;
+  // Keeps the buffers of the largest request served
+  FaceDetectionWorkspace workspace;
+  // Rings registered by co-located clients, nullptr if disabled
+  std::unique_ptr<SharedMemoryServer> sharedMemory;
+  // Declared last, pending calls finish before the members above are destroyed
+  WorkerPool workers;
 
-  grpc::Status serve(grpc::ServerContext *context,
-                     const FaceDetectionRequest *request,
-                     FaceDetectionResponse *response) override {
+  /**
+   * @brief Handle one serve call on a worker
+   */
+  grpc::Status detect(const FaceDetectionRequest *request,
+                      FaceDetectionResponse *response) {
     auto start = std::chrono::steady_clock::now();
-    auto image = cv::imdecode(
-        std::vector<uchar>(request->image().begin(), request->image().end()),
-        cv::IMREAD_COLOR);
-    auto result = faceDetection(engine.get(), image, true, .1, .9);
+    std::shared_ptr<SharedMemoryRing> ring;
+    if (request->has_slot()) {
+      if (sharedMemory) {
+        ring = sharedMemory->find(request->slot().token());
+      }
+      if (!ring) {
+        return grpc::Status(grpc::StatusCode::NOT_FOUND,
+                            "Shared memory not registered");
+      }
+      if (request->slot().index() >= ring->getSlotCount()) {
+        return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                            "Invalid shared memory slot");
+      }
+    }
+    // The slot is released on every return below, after the image is used
+    SlotReleaser releaser(ring, request->slot().index());
+    int cropSize = request->crop().size() ? request->crop().size() : 112;
+    if (cropSize < 0 || cropSize > MAX_CROP_SIZE) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "Invalid crop size");
+    }
+    cv::Mat image;
+    if (request->has_slot()) {
+      auto &slot = request->slot();
+      auto data = ring->getSlot(slot.index());
+      if (!slot.size() || slot.size() > ring->getSlotSize()) {
+        return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                            "Invalid shared memory slot size");
+      }
+      if (slot.width() || slot.height()) {
+        if (slot.width() <= 0 || slot.height() <= 0 ||
+            (std::uint64_t)slot.width() * slot.height() * 3 != slot.size()) {
+          return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                              "Invalid raw image size");
+        }
+        // Detect directly on the mapped frame, no copy before preprocessing
+        image = cv::Mat(slot.height(), slot.width(), CV_8UC3, data);
+      } else {
+        image = decode(data, slot.size());
+      }
+    } else {
+      image = decode(request->image().data(), request->image().size());
+    }
+    if (image.empty()) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Invalid image");
+    }
+    // result and crops are read from the shared workspace under the lock,
+    // decoding above and crop encoding below run in parallel
+    std::unique_lock<std::mutex> engineLock(engineMutex);
+    auto &result = faceDetection(engine.get(), image, workspace,
+                                 FaceDetectionMode::SLIDE, .1, .9);
     for (auto &bboxItem : result.bbox) {
       auto bbox = response->add_bbox();
       bbox->set_x(bboxItem.x);
@@ -43,29 +295,84 @@ public:
         point->set_y(landmarkItem.at<double>(i, 1));
       }
     }
+    int faceCount = result.bbox.size();
+    auto allocations = workspace.lastAllocations;
+    thread_local cv::Mat crops;
+    if (request->has_crop()) {
+      if ((std::uint64_t)faceCount * cropSize * cropSize * image.elemSize() >
+          MAX_CROP_BYTES) {
+        return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                            "Too many face crops, request a smaller size");
+      }
+      alignFaces(image, result, cropSize, crops);
+    }
+    engineLock.unlock();
+    if (request->has_crop()) {
+      thread_local std::vector<uchar> cropBuffer;
+      for (int i = 0; i < faceCount; i++) {
+        auto crop = crops.rowRange(i * cropSize, (i + 1) * cropSize);
+        if (request->crop().jpeg()) {
+          cv::imencode(".jpg", crop, cropBuffer);
+          response->add_crop(cropBuffer.data(), cropBuffer.size());
+        } else {
+          response->add_crop(crop.data, crop.total() * crop.elemSize());
+        }
+      }
+    }
     auto end = std::chrono::steady_clock::now();
     std::cout << "Inference used "
               << std::chrono::duration<double, std::milli>(end - start).count()
-              << "ms, detected " << result.bbox.size() << " faces" << std::endl;
+              << "ms, detected " << faceCount << " faces, " << allocations
+              << " workspace allocations"
+              << std::endl;
     return grpc::Status::OK;
   }
 
-private:
-  std::unique_ptr<InferEngine> engine;
+  /**
+   * @brief Decode encoded image
+   * @return
+   * Decoded image, empty if data is empty, too large or invalid
+   */
+  static cv::Mat decode(const void *data, std::size_t size) {
+    if (!size || size > INT_MAX) {
+      return cv::Mat();
+    }
+    try {
+      return cv::imdecode(cv::Mat(1, (int)size, CV_8U, (void *)data),
+                          cv::IMREAD_COLOR);
+    } catch (const cv::Exception &) {
+      return cv::Mat();
+    }
+  }
 };
 
 void runServer(const std::string &serverAddress,
-               const std::string &engineFilePath) {
-  FaceDetectionServiceImpl service(engineFilePath);
+               const std::string &engineFilePath,
+               const std::string &sharedMemoryPath,
+               const std::unordered_map<std::string, float> &outputScale) {
+  FaceDetectionServiceImpl service(engineFilePath, sharedMemoryPath,
+                                   outputScale);
   grpc::ServerBuilder builder;
   builder.AddListeningPort(serverAddress, grpc::InsecureServerCredentials());
   builder.RegisterService(&service);
   std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
   std::cout << "Server listening on " << serverAddress << std::endl;
+  if (!sharedMemoryPath.empty()) {
+    std::cout << "Shared memory side channel on " << sharedMemoryPath
+              << std::endl;
+  }
   server->Wait();
 }
 
 int main(int argc, char **argv) {
-  runServer(argv[1], argv[2]);
+  // Optional: unix socket path of the shared memory side channel ("" to
+  // disable), quantization scales of INT8 outputs as in parseOutputScale
+  try {
+    runServer(argv[1], argv[2], argc > 3 ? argv[3] : "",
+              parseOutputScale(argc > 4 ? argv[4] : ""));
+  } catch (const std::exception &error) {
+    std::cerr << error.what() << std::endl;
+    return 1;
+  }
   return 0;
 }
@@ -0,0 +1,384 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "shm.hpp"
+
+namespace sharedMemoryImpl {
+static const std::uint64_t MAGIC = 0x474e495245434146ULL; // "FACERING"
+static const std::uint64_t PAGE_SIZE = 4096;
+static const std::uint64_t SLOT_ALIGNMENT = 64;
+static const std::uint32_t FREE = 0;
+static const std::uint32_t BUSY = 1;
+static const std::size_t TOKEN_SIZE = 16;
+static const std::size_t MAX_CONNECTIONS = 256;
+
+static_assert(std::atomic<std::uint32_t>::is_always_lock_free,
+              "Slot state must be lock free to be shared between processes");
+
+inline std::uint64_t alignUp(std::uint64_t value, std::uint64_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+inline std::system_error systemError(const std::string &what) {
+  return std::system_error(errno, std::generic_category(), what);
+}
+
+inline sockaddr_un getAddress(const std::string &path) {
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    throw std::invalid_argument("Invalid unix socket path " + path);
+  }
+  std::memcpy(address.sun_path, path.data(), path.size());
+  return address;
+}
+} // namespace sharedMemoryImpl
+
+SharedMemoryRing::SharedMemoryRing(std::uint32_t slotCount,
+                                   std::uint64_t slotSize)
+    : fd(-1), addr(nullptr), size(0), slotCount(slotCount) {
+  if (!slotCount || !slotSize) {
+    throw std::invalid_argument("Empty shared memory ring");
+  }
+  this->slotSize =
+      sharedMemoryImpl::alignUp(slotSize, sharedMemoryImpl::SLOT_ALIGNMENT);
+  std::uint64_t dataOffset = sharedMemoryImpl::alignUp(
+      sizeof(Header) +
+          (std::uint64_t)slotCount * sizeof(std::atomic<std::uint32_t>),
+      sharedMemoryImpl::PAGE_SIZE);
+  if (this->slotSize < slotSize ||
+      this->slotSize > (UINT64_MAX - dataOffset) / slotCount) {
+    throw std::invalid_argument("Shared memory ring too large");
+  }
+  std::uint64_t mapSize = dataOffset + slotCount * this->slotSize;
+  fd = memfd_create("face-grpc-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    throw sharedMemoryImpl::systemError("memfd_create");
+  }
+  // Sealed size, mappings of the peer can not be truncated into SIGBUS
+  if (ftruncate(fd, mapSize) ||
+      fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)) {
+    auto error = sharedMemoryImpl::systemError("seal shared memory ring");
+    close(fd);
+    throw error;
+  }
+  try {
+    map(mapSize);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  header->slotCount = slotCount;
+  header->slotSize = this->slotSize;
+  header->dataOffset = dataOffset;
+  state = (std::atomic<std::uint32_t> *)(header + 1);
+  for (std::uint32_t i = 0; i < slotCount; i++) {
+    new (state + i) std::atomic<std::uint32_t>(sharedMemoryImpl::FREE);
+  }
+  data = (unsigned char *)addr + dataOffset;
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = sharedMemoryImpl::MAGIC;
+}
+
+SharedMemoryRing::SharedMemoryRing(int fd)
+    : fd(fd), addr(nullptr), size(0), slotCount(0), slotSize(0) {
+  int seals = fcntl(fd, F_GET_SEALS);
+  if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+    close(fd);
+    throw std::runtime_error(
+        "Shared memory ring is not a memfd sealed against shrinking");
+  }
+  struct stat fileStat;
+  if (fstat(fd, &fileStat)) {
+    auto error = sharedMemoryImpl::systemError("fstat shared memory ring");
+    close(fd);
+    throw error;
+  }
+  if (!S_ISREG(fileStat.st_mode) ||
+      (std::uint64_t)fileStat.st_size < sizeof(Header)) {
+    close(fd);
+    throw std::runtime_error("Invalid shared memory ring");
+  }
+  try {
+    map(fileStat.st_size);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  // Copy the layout once, the peer can still write the header afterwards
+  slotCount = header->slotCount;
+  slotSize = header->slotSize;
+  std::uint64_t dataOffset = header->dataOffset;
+  if (header->magic != sharedMemoryImpl::MAGIC || !slotCount || !slotSize ||
+      dataOffset < sizeof(Header) + (std::uint64_t)slotCount *
+                                        sizeof(std::atomic<std::uint32_t>) ||
+      dataOffset > size || (size - dataOffset) / slotCount < slotSize) {
+    munmap(addr, size);
+    close(fd);
+    throw std::runtime_error("Invalid shared memory ring");
+  }
+  state = (std::atomic<std::uint32_t> *)(header + 1);
+  data = (unsigned char *)addr + dataOffset;
+}
+
+SharedMemoryRing::~SharedMemoryRing() {
+  munmap(addr, size);
+  close(fd);
+}
+
+void SharedMemoryRing::map(std::size_t mapSize) {
+  addr = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    throw sharedMemoryImpl::systemError("mmap shared memory ring");
+  }
+  size = mapSize;
+  header = (Header *)addr;
+}
+
+int SharedMemoryRing::acquire() {
+  for (std::uint32_t i = 0; i < slotCount; i++) {
+    std::uint32_t expected = sharedMemoryImpl::FREE;
+    if (state[i].compare_exchange_strong(expected, sharedMemoryImpl::BUSY,
+                                         std::memory_order_acquire)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool SharedMemoryRing::release(std::uint32_t slot) {
+  if (slot >= slotCount) {
+    return false;
+  }
+  std::uint32_t expected = sharedMemoryImpl::BUSY;
+  return state[slot].compare_exchange_strong(expected, sharedMemoryImpl::FREE,
+                                             std::memory_order_release);
+}
+
+unsigned char *SharedMemoryRing::getSlot(std::uint32_t slot) {
+  return data + slot * slotSize;
+}
+
+SharedMemoryServer::SharedMemoryServer(const std::string &path)
+    : path(path), listenFd(-1), wakeFd{-1, -1} {
+  auto address = sharedMemoryImpl::getAddress(path);
+  listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (listenFd < 0) {
+    throw sharedMemoryImpl::systemError("socket " + path);
+  }
+  // Only a stale socket of a previous server is replaced, bind fails on
+  // any other file at path
+  struct stat status;
+  if (lstat(path.c_str(), &status) == 0 && S_ISSOCK(status.st_mode)) {
+    unlink(path.c_str());
+  }
+  if (bind(listenFd, (sockaddr *)&address, sizeof(address))) {
+    auto error = sharedMemoryImpl::systemError("bind " + path);
+    close(listenFd);
+    throw error;
+  }
+  if (listen(listenFd, 16) || pipe2(wakeFd, O_CLOEXEC)) {
+    auto error = sharedMemoryImpl::systemError("listen " + path);
+    close(listenFd);
+    unlink(path.c_str());
+    throw error;
+  }
+  thread = std::thread([this] { run(); });
+}
+
+SharedMemoryServer::~SharedMemoryServer() {
+  char wake = 0;
+  while (write(wakeFd[1], &wake, 1) < 0 && errno == EINTR) {
+  }
+  thread.join();
+  for (auto &connection : connections) {
+    close(connection.first);
+  }
+  close(listenFd);
+  close(wakeFd[0]);
+  close(wakeFd[1]);
+  unlink(path.c_str());
+}
+
+std::shared_ptr<SharedMemoryRing>
+SharedMemoryServer::find(const std::string &token) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto iter = rings.find(token);
+  return iter == rings.end() ? nullptr : iter->second;
+}
+
+void SharedMemoryServer::run() {
+  std::vector<pollfd> pollFds;
+  while (true) {
+    pollFds.clear();
+    pollFds.push_back({wakeFd[0], POLLIN, 0});
+    pollFds.push_back({listenFd, POLLIN, 0});
+    for (auto &connection : connections) {
+      pollFds.push_back({connection.first, POLLIN, 0});
+    }
+    if (poll(pollFds.data(), pollFds.size(), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    if (pollFds[0].revents) {
+      return;
+    }
+    for (std::size_t i = 2; i < pollFds.size(); i++) {
+      if (pollFds[i].revents) {
+        receive(pollFds[i].fd);
+      }
+    }
+    if (pollFds[1].revents & POLLIN) {
+      accept();
+    }
+  }
+}
+
+void SharedMemoryServer::accept() {
+  int connectionFd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+  if (connectionFd < 0) {
+    return;
+  }
+  if (connections.size() >= sharedMemoryImpl::MAX_CONNECTIONS) {
+    close(connectionFd);
+    return;
+  }
+  // Empty token until the client sends its ring
+  connections[connectionFd];
+}
+
+void SharedMemoryServer::receive(int connectionFd) {
+  char byte;
+  iovec iov = {&byte, 1};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+  msghdr message;
+  std::memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  auto received =
+      recvmsg(connectionFd, &message, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+  if (received < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  int ringFd = -1;
+  for (auto cmsg = CMSG_FIRSTHDR(&message); received > 0 && cmsg;
+       cmsg = CMSG_NXTHDR(&message, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+      std::memcpy(&ringFd, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+  // End of connection, a second message, or anything but exactly one fd
+  if (received <= 0 || ringFd < 0 || (message.msg_flags & MSG_CTRUNC) ||
+      !connections[connectionFd].empty()) {
+    if (ringFd >= 0) {
+      close(ringFd);
+    }
+    drop(connectionFd);
+    return;
+  }
+  std::shared_ptr<SharedMemoryRing> ring;
+  try {
+    ring = std::make_shared<SharedMemoryRing>(ringFd);
+  } catch (const std::exception &) {
+    drop(connectionFd);
+    return;
+  }
+  std::string token(sharedMemoryImpl::TOKEN_SIZE, '\0');
+  if (getrandom(&token[0], token.size(), 0) != (ssize_t)token.size()) {
+    drop(connectionFd);
+    return;
+  }
+  {
+    // Registered before the client gets the token and can use it
+    std::lock_guard<std::mutex> lock(mutex);
+    rings[token] = std::move(ring);
+  }
+  connections[connectionFd] = token;
+  if (send(connectionFd, token.data(), token.size(), MSG_NOSIGNAL) !=
+      (ssize_t)token.size()) {
+    drop(connectionFd);
+  }
+}
+
+void SharedMemoryServer::drop(int connectionFd) {
+  auto iter = connections.find(connectionFd);
+  if (!iter->second.empty()) {
+    // In-flight requests hold their own reference to the mapping
+    std::lock_guard<std::mutex> lock(mutex);
+    rings.erase(iter->second);
+  }
+  close(connectionFd);
+  connections.erase(iter);
+}
+
+SharedMemoryClient::SharedMemoryClient(const std::string &path,
+                                       std::uint32_t slotCount,
+                                       std::uint64_t slotSize)
+    : ring(slotCount, slotSize), socketFd(-1) {
+  auto address = sharedMemoryImpl::getAddress(path);
+  socketFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (socketFd < 0) {
+    throw sharedMemoryImpl::systemError("socket " + path);
+  }
+  if (connect(socketFd, (sockaddr *)&address, sizeof(address))) {
+    auto error = sharedMemoryImpl::systemError("connect " + path);
+    close(socketFd);
+    throw error;
+  }
+  char byte = 0;
+  iovec iov = {&byte, 1};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+  std::memset(control, 0, sizeof(control));
+  msghdr message;
+  std::memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  auto cmsg = CMSG_FIRSTHDR(&message);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  int ringFd = ring.getFd();
+  std::memcpy(CMSG_DATA(cmsg), &ringFd, sizeof(int));
+  if (sendmsg(socketFd, &message, MSG_NOSIGNAL) != 1) {
+    auto error = sharedMemoryImpl::systemError("send to " + path);
+    close(socketFd);
+    throw error;
+  }
+  token.resize(sharedMemoryImpl::TOKEN_SIZE);
+  auto received = recv(socketFd, &token[0], token.size(), 0);
+  if (received != (ssize_t)token.size()) {
+    close(socketFd);
+    throw std::runtime_error("Shared memory ring rejected by " + path);
+  }
+}
+
+SharedMemoryClient::~SharedMemoryClient() { close(socketFd); }
@@ -0,0 +1,195 @@
+#ifndef PROJECT_SRC_SHM_HPP_
+#define PROJECT_SRC_SHM_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+/**
+ * @class SharedMemoryRing
+ * @brief Fixed-size slots in a sealed memfd,
+ * shared by a co-located client and server,
+ * the client acquires a slot and writes an image into it,
+ * the server releases the slot once the image is no longer needed
+ */
+class SharedMemoryRing {
+public:
+  SharedMemoryRing() = delete;
+  /**
+   * @brief Constructor, create memfd sealed against shrinking and growing,
+   * so that mappings of other processes stay valid
+   * @param slotCount
+   * Number of slots
+   * @param slotSize
+   * Size in bytes of each slot
+   */
+  SharedMemoryRing(std::uint32_t slotCount, std::uint64_t slotSize);
+  /**
+   * @brief Constructor, map memfd created by another process
+   * @param fd
+   * memfd received from another process, must be sealed against shrinking,
+   * owned (and closed) by this object
+   */
+  explicit SharedMemoryRing(int fd);
+  /**
+   * @brief Destructor
+   */
+  ~SharedMemoryRing();
+  SharedMemoryRing(const SharedMemoryRing &) = delete;
+  SharedMemoryRing &operator=(const SharedMemoryRing &) = delete;
+
+  /**
+   * @brief Get memfd, e.g. to send to another process
+   */
+  int getFd() const { return fd; }
+  /**
+   * @brief Get number of slots
+   */
+  std::uint32_t getSlotCount() const { return slotCount; }
+  /**
+   * @brief Get size in bytes of each slot
+   */
+  std::uint64_t getSlotSize() const { return slotSize; }
+
+  /**
+   * @brief Acquire a free slot
+   * @return
+   * Slot index, -1 if all slots are in use
+   */
+  int acquire();
+  /**
+   * @brief Release an acquired slot
+   * @param slot
+   * Slot index
+   * @return
+   * false if slot is out of range or not acquired
+   */
+  bool release(std::uint32_t slot);
+  /**
+   * @brief Get slot data
+   * @param slot
+   * Slot index, must be less than getSlotCount()
+   * @return
+   * Pointer to getSlotSize() bytes
+   */
+  unsigned char *getSlot(std::uint32_t slot);
+
+private:
+  struct Header {
+    std::uint64_t magic;
+    std::uint32_t slotCount;
+    std::uint32_t reserved;
+    std::uint64_t slotSize;
+    std::uint64_t dataOffset;
+  };
+
+  int fd;
+  void *addr;
+  std::size_t size;
+  Header *header;
+  std::uint32_t slotCount;
+  std::uint64_t slotSize;
+  std::atomic<std::uint32_t> *state;
+  unsigned char *data;
+
+  void map(std::size_t mapSize);
+};
+
+/**
+ * @class SharedMemoryServer
+ * @brief Unix socket side channel receiving SharedMemoryRing memfds
+ * from co-located clients, each client connection registers one ring
+ * identified by a random token, the ring is dropped when the connection
+ * closes, including when the client dies
+ */
+class SharedMemoryServer {
+public:
+  SharedMemoryServer() = delete;
+  /**
+   * @brief Constructor, listen on unix socket and start receiving rings
+   * @param path
+   * Unix socket path, a stale socket at path is replaced, any other file
+   * makes the constructor throw std::system_error, unlinked by destructor
+   */
+  explicit SharedMemoryServer(const std::string &path);
+  /**
+   * @brief Destructor
+   */
+  ~SharedMemoryServer();
+  SharedMemoryServer(const SharedMemoryServer &) = delete;
+  SharedMemoryServer &operator=(const SharedMemoryServer &) = delete;
+
+  /**
+   * @brief Find ring by token
+   * @param token
+   * Token returned to the client that registered the ring
+   * @return
+   * Ring, nullptr if not registered or already dropped,
+   * in-flight requests keep the mapping alive
+   */
+  std::shared_ptr<SharedMemoryRing> find(const std::string &token);
+
+private:
+  std::string path;
+  int listenFd;
+  int wakeFd[2];
+  std::thread thread;
+  std::mutex mutex;
+  // Connection fd and token of its ring
+  std::unordered_map<int, std::string> connections;
+  std::unordered_map<std::string, std::shared_ptr<SharedMemoryRing>> rings;
+
+  void run();
+  void accept();
+  void receive(int connectionFd);
+  void drop(int connectionFd);
+};
+
+/**
+ * @class SharedMemoryClient
+ * @brief Create a SharedMemoryRing and register it with SharedMemoryServer,
+ * the server drops the ring when this object is destroyed
+ */
+class SharedMemoryClient {
+public:
+  SharedMemoryClient() = delete;
+  /**
+   * @brief Constructor
+   * @param path
+   * Unix socket path of SharedMemoryServer
+   * @param slotCount
+   * Number of slots
+   * @param slotSize
+   * Size in bytes of each slot
+   */
+  SharedMemoryClient(const std::string &path, std::uint32_t slotCount,
+                     std::uint64_t slotSize);
+  /**
+   * @brief Destructor
+   */
+  ~SharedMemoryClient();
+  SharedMemoryClient(const SharedMemoryClient &) = delete;
+  SharedMemoryClient &operator=(const SharedMemoryClient &) = delete;
+
+  /**
+   * @brief Get registered ring
+   */
+  SharedMemoryRing &getRing() { return ring; }
+  /**
+   * @brief Get token identifying the ring in requests
+   */
+  const std::string &getToken() const { return token; }
+
+private:
+  SharedMemoryRing ring;
+  int socketFd;
+  std::string token;
+};
+
+#endif
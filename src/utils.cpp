@@ -1,9 +1,14 @@
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 
 #include <algorithm>
 #include <fstream>
+#include <limits>
 #include <memory>
+#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <utility>
@@ -11,7 +16,7 @@
 
 #include <NvInfer.h>
 #include <opencv2/core.hpp>
-#include <opencv2/dnn.hpp>
+#include <opencv2/imgproc.hpp>
 
 #include "engine.hpp"
 #include "utils.hpp"
@@ -21,6 +26,13 @@ static const int MIN_SIZES[][2] = {{16, 32}, {64, 128}, {256, 512}};
 static const int STEPS[] = {8, 16, 32};
 static const double VAR[] = {.1, .2};
 static const int INPUT_SIZE[] = {640, 640};
+static const double MEAN[] = {104., 117., 123.};
+static const double ALIGN_SIZE = 112.;
+static const double ALIGN_TEMPLATE[][2] = {{38.2946, 51.6963},
+                                           {73.5318, 51.5014},
+                                           {56.0252, 71.7366},
+                                           {41.5493, 92.3655},
+                                           {70.7299, 92.2041}};
 static const int OUTPUT_SIZE =
     ((int)std::ceil((double)INPUT_SIZE[0] / STEPS[0]) *
          (int)std::ceil((double)INPUT_SIZE[1] / STEPS[0]) +
@@ -29,10 +41,60 @@ static const int OUTPUT_SIZE =
      (int)std::ceil((double)INPUT_SIZE[0] / STEPS[2]) *
          (int)std::ceil((double)INPUT_SIZE[1] / STEPS[2])) *
     2;
+static const int SCORE_CHUNK_SIZE = 512;
 
 static cv::Mat prior;
 static bool priorInitialized = false;
 
+/**
+ * @brief Scratch memory behind FaceDetectionWorkspace
+ */
+struct Workspace {
+  InferWorkspace infer;
+  // Buffer (re)allocations, excluding infer
+  std::uint64_t allocations = 0;
+  int lastWindows = 0;
+  std::vector<FaceDetectionResult> results;
+
+  // Windows of all images and their input blobs
+  std::vector<cv::Mat> windows;
+  std::vector<cv::Rect2d> windowRects;
+  std::vector<int> windowImages;
+  std::vector<unsigned char> windowSelected;
+  cv::Mat resized;
+  std::vector<cv::Mat> channels;
+  cv::Mat inputBuffer[2];
+  // 4-D headers over inputBuffer by window count, rebuilding them per
+  // chunk would allocate their size and step arrays
+  std::vector<cv::Mat> inputData[2];
+  std::unordered_map<std::string, cv::Mat> input[2];
+
+  // Decoding of one window
+  std::vector<std::pair<float, int>> scoreIndex;
+  std::vector<int> indicesBeforeNMS;
+  std::vector<cv::Rect2d> bboxBeforeNMS;
+  std::vector<float> scoreBeforeNMS;
+  std::vector<int> indicesAfterNMS;
+  std::vector<int> landmarkIndices;
+  cv::Mat rawRows;
+  cv::Mat rows;
+
+  // Detections of all windows and the final NMS of each image
+  std::vector<cv::Rect2d> bbox;
+  std::vector<float> score;
+  std::vector<int> bboxImages;
+  cv::Mat landmark;
+  std::vector<cv::Rect2d> imageBbox;
+  std::vector<float> imageScore;
+  std::vector<int> imageIndices;
+  std::vector<int> indices;
+  std::vector<std::pair<float, int>> nmsOrder;
+};
+
+Workspace &getWorkspace(FaceDetectionWorkspace &workspace) {
+  return *workspace.impl;
+}
+
 void initPrior() {
   if (priorInitialized) {
     return;
@@ -56,6 +118,99 @@ void initPrior() {
   priorInitialized = true;
 }
 
+template <typename T>
+inline void reserve(std::vector<T> &buffer, std::size_t size,
+                    std::uint64_t &allocations) {
+  if (buffer.capacity() < size) {
+    buffer.reserve(size);
+    allocations++;
+  }
+}
+
+inline void reserve(cv::Mat &buffer, std::size_t size, int type,
+                    std::uint64_t &allocations) {
+  if (buffer.empty() || buffer.type() != type || buffer.total() < size) {
+    buffer.create(1, (int)size, type);
+    allocations++;
+  }
+}
+
+/**
+ * @brief Convert raw output values to FP32 by OpenCV (SIMD) conversion,
+ * INT8 values are dequantized by scale, FP16 values are not scaled
+ */
+inline void convertValues(float *dst, const void *src, int size, int depth,
+                          float scale) {
+  cv::Mat srcValues(1, size, depth, (void *)src);
+  cv::Mat dstValues(1, size, CV_32F, dst);
+  srcValues.convertTo(dstValues, CV_32F, depth == CV_8S ? scale : 1.);
+}
+
+/**
+ * @brief Collect (score, index) of anchors passing score threshold,
+ * FP16 and INT8 scores are converted chunk by chunk,
+ * each chunk is filtered while it is still in cache
+ * @return
+ * End of collected entries
+ */
+std::pair<float, int> *filterScore(std::pair<float, int> *scoreIndex,
+                                   const cv::Mat &rawScore, int batch,
+                                   float scoreThreshold, float scale) {
+  float chunkData[SCORE_CHUNK_SIZE * 2];
+  const uchar *rawScoreData = rawScore.ptr(batch);
+  for (int start = 0; start < OUTPUT_SIZE; start += SCORE_CHUNK_SIZE) {
+    int size = std::min(SCORE_CHUNK_SIZE, OUTPUT_SIZE - start);
+    const float *chunk = chunkData;
+    if (rawScore.depth() == CV_32F) {
+      chunk = (const float *)rawScoreData + start * 2;
+    } else {
+      convertValues(chunkData,
+                    rawScoreData + start * 2 * rawScore.elemSize(),
+                    size * 2, rawScore.depth(), scale);
+    }
+    for (int i = 0; i < size; i++) {
+      if (chunk[i * 2 + 1] >= scoreThreshold) {
+        scoreIndex->first = chunk[i * 2 + 1];
+        (scoreIndex++)->second = start + i;
+      }
+    }
+  }
+  return scoreIndex;
+}
+
+/**
+ * @brief Gather rows of raw output by anchor index and convert them to FP32,
+ * FP16 and INT8 rows are converted by one OpenCV (SIMD) conversion
+ * @return
+ * FP32 rows stored in workspace, row i belongs to anchor indices[i],
+ * valid until next call
+ */
+const float *convertRows(const cv::Mat &raw, int batch, const int *indices,
+                         int count, int rowSize, float scale,
+                         Workspace &workspace) {
+  if (!count) {
+    return nullptr;
+  }
+  std::size_t rowBytes = rowSize * raw.elemSize();
+  reserve(workspace.rows, count * rowSize, CV_32F, workspace.allocations);
+  uchar *gathered = workspace.rows.data;
+  if (raw.depth() != CV_32F) {
+    reserve(workspace.rawRows, count * rowBytes, CV_8U,
+            workspace.allocations);
+    gathered = workspace.rawRows.data;
+  }
+  const uchar *rawData = raw.ptr(batch);
+  for (int i = 0; i < count; i++) {
+    std::memcpy(gathered + i * rowBytes, rawData + indices[i] * rowBytes,
+                rowBytes);
+  }
+  float *rows = (float *)workspace.rows.data;
+  if (raw.depth() != CV_32F) {
+    convertValues(rows, gathered, count * rowSize, raw.depth(), scale);
+  }
+  return rows;
+}
+
 inline void decodeBbox(cv::Rect2d &bboxItem, const float *rawBboxItem,
                        const double *priorItem) {
   bboxItem.width = std::exp(rawBboxItem[2] * VAR[1]) * priorItem[2];
@@ -66,190 +221,604 @@ inline void decodeBbox(cv::Rect2d &bboxItem, const float *rawBboxItem,
                bboxItem.height / 2.;
 }
 
-inline void decodeLandmark(cv::Mat &landmarkItem, const float *rawLandmarkItem,
+inline void decodeLandmark(double *landmarkItemData,
+                           const float *rawLandmarkItem,
                            const double *priorItem) {
-  landmarkItem.create(5, 2, CV_64F);
-  double *landmarkItemData = (double *)landmarkItem.data;
-  *landmarkItemData++ =
-      *rawLandmarkItem++ * VAR[0] * priorItem[2] + priorItem[0];
-  *landmarkItemData++ =
-      *rawLandmarkItem++ * VAR[0] * priorItem[3] + priorItem[1];
-  *landmarkItemData++ =
-      *rawLandmarkItem++ * VAR[0] * priorItem[2] + priorItem[0];
-  *landmarkItemData++ =
-      *rawLandmarkItem++ * VAR[0] * priorItem[3] + priorItem[1];
-  *landmarkItemData++ =
-      *rawLandmarkItem++ * VAR[0] * priorItem[2] + priorItem[0];
-  *landmarkItemData++ =
-      *rawLandmarkItem++ * VAR[0] * priorItem[3] + priorItem[1];
-  *landmarkItemData++ =
-      *rawLandmarkItem++ * VAR[0] * priorItem[2] + priorItem[0];
-  *landmarkItemData++ =
-      *rawLandmarkItem++ * VAR[0] * priorItem[3] + priorItem[1];
-  *landmarkItemData++ =
-      *rawLandmarkItem++ * VAR[0] * priorItem[2] + priorItem[0];
-  *landmarkItemData++ =
-      *rawLandmarkItem++ * VAR[0] * priorItem[3] + priorItem[1];
+  for (int i = 0; i < 5; i++) {
+    *landmarkItemData++ =
+        *rawLandmarkItem++ * VAR[0] * priorItem[2] + priorItem[0];
+    *landmarkItemData++ =
+        *rawLandmarkItem++ * VAR[0] * priorItem[3] + priorItem[1];
+  }
 }
-} // namespace faceDetectionImpl
 
-InferEngine *createFaceDetector(const std::string &engineFilePath,
-                                int batchSize,
-                                nvinfer1::ILogger::Severity logLevel) {
-  std::ifstream engineFile(engineFilePath, std::ios::binary);
-  engineFile.seekg(0, std::ifstream::end);
-  auto engineFileSize = engineFile.tellg();
-  engineFile.seekg(0, std::ifstream::beg);
-  std::unique_ptr<char[]> engineData(new char[engineFileSize]);
-  engineFile.read(engineData.get(), engineFileSize);
-  return new InferEngine(engineData.get(), engineFileSize,
-                         {{"input",
-                           {3, faceDetectionImpl::INPUT_SIZE[0],
-                            faceDetectionImpl::INPUT_SIZE[1]}}},
-                         {{"bbox", {faceDetectionImpl::OUTPUT_SIZE, 4}},
-                          {"score", {faceDetectionImpl::OUTPUT_SIZE, 2}},
-                          {"landmark", {faceDetectionImpl::OUTPUT_SIZE, 10}}},
-                         batchSize, logLevel);
+/**
+ * @brief Greedy non-maximum suppression in workspace buffers,
+ * same result as cv::dnn::NMSBoxes(bbox, score, scoreThreshold,
+ * nmsThreshold, indices, 1.F, topK) without its temporary vectors
+ */
+void nmsBoxes(const std::vector<cv::Rect2d> &bbox,
+              const std::vector<float> &score, float scoreThreshold,
+              float nmsThreshold, int topK, std::vector<int> &indices,
+              Workspace &workspace) {
+  auto &nmsOrder = workspace.nmsOrder;
+  reserve(nmsOrder, score.size(), workspace.allocations);
+  reserve(indices, std::min<std::size_t>(topK, score.size()),
+          workspace.allocations);
+  nmsOrder.clear();
+  indices.clear();
+  for (std::size_t i = 0; i < score.size(); i++) {
+    if (score[i] > scoreThreshold) {
+      nmsOrder.emplace_back(score[i], i);
+    }
+  }
+  // Equal scores keep input order, as the stable sort of cv::dnn::NMSBoxes
+  std::sort(nmsOrder.begin(), nmsOrder.end(),
+            [](const std::pair<float, int> &a, const std::pair<float, int> &b) {
+              if (a.first == b.first) {
+                return a.second < b.second;
+              }
+              return a.first > b.first;
+            });
+  if (topK > 0 && (std::size_t)topK < nmsOrder.size()) {
+    nmsOrder.resize(topK);
+  }
+  for (auto &scoreIndex : nmsOrder) {
+    auto &bboxItem = bbox[scoreIndex.second];
+    bool keep = true;
+    for (std::size_t k = 0; k < indices.size() && keep; k++) {
+      auto &keptItem = bbox[indices[k]];
+      double areaSum = bboxItem.area() + keptItem.area();
+      // Same as cv::jaccardDistance, two empty boxes overlap fully
+      float overlap = 1.F;
+      if (areaSum > std::numeric_limits<double>::epsilon()) {
+        double intersection = (bboxItem & keptItem).area();
+        overlap = 1.F - (float)(1. - intersection / (areaSum - intersection));
+      }
+      keep = overlap <= nmsThreshold;
+    }
+    if (keep) {
+      indices.push_back(scoreIndex.second);
+    }
+  }
 }
 
-FaceDetectionResult faceDetection(InferEngine *engine, const cv::Mat &image,
-                                  bool slide, float nmsThreshold,
-                                  float scoreThreshold, int keepBeforeNMS,
-                                  int topK) {
-  cv::Mat inputData;
-  int rows = 0, cols = 0;
-  if (slide) {
-    int halfWidth = std::ceil((double)faceDetectionImpl::INPUT_SIZE[1] / 2),
-        halfHeight = std::ceil((double)faceDetectionImpl::INPUT_SIZE[0] / 2);
-    rows = (int)std::ceil((double)std::max(image.rows, halfHeight * 2) /
-                          halfHeight) -
-           1;
-    cols = (int)std::ceil((double)std::max(image.cols, halfWidth * 2) /
-                          halfWidth) -
-           1;
-    std::vector<cv::Mat> windows(rows * cols + 1);
-    for (int i = 0; i < rows; i++) {
-      for (int j = 0; j < cols; j++) {
-        windows[i * cols + j] = image(
-            cv::Rect(j * image.cols / (cols + 1), i * image.rows / (rows + 1),
-                     2 * image.cols / (cols + 1), 2 * image.rows / (rows + 1)));
+/**
+ * @brief 4-D input blob header over the first count windows of buffer
+ */
+inline cv::Mat getInputData(const cv::Mat &inputBuffer, int count) {
+  int sizes[] = {count, 3, INPUT_SIZE[0], INPUT_SIZE[1]};
+  return inputBuffer.colRange(0, count * 3 * INPUT_SIZE[0] * INPUT_SIZE[1])
+      .reshape(1, 4, sizes);
+}
+
+/**
+ * @brief Fill input blob slot of workspace from workspace windows
+ * [begin, begin + count), same as cv::dnn::blobFromImages
+ * but without temporary buffers
+ */
+void prepareInput(Workspace &workspace, int begin, int count, int slot) {
+  int planeSize = INPUT_SIZE[0] * INPUT_SIZE[1];
+  int inputSize = count * 3 * planeSize;
+  auto &inputBuffer = workspace.inputBuffer[slot];
+  auto &slotData = workspace.inputData[slot];
+  auto bufferData = inputBuffer.data;
+  reserve(inputBuffer, inputSize, CV_32F, workspace.allocations);
+  if (inputBuffer.data != bufferData) {
+    // Move headers of every count seen, e.g. both cascade passes,
+    // so that the next call does not rebuild them
+    for (std::size_t i = 0; i < slotData.size(); i++) {
+      if (!slotData[i].empty()) {
+        slotData[i] = getInputData(inputBuffer, i);
       }
     }
-    windows[rows * cols] = image;
-    inputData = cv::dnn::blobFromImages(
-        windows, 1.,
-        cv::Size(faceDetectionImpl::INPUT_SIZE[0],
-                 faceDetectionImpl::INPUT_SIZE[1]),
-        cv::Scalar(104., 117., 123.), false, false, CV_32F);
-  } else {
-    inputData = cv::dnn::blobFromImage(
-        image, 1.,
-        cv::Size(faceDetectionImpl::INPUT_SIZE[0],
-                 faceDetectionImpl::INPUT_SIZE[1]),
-        cv::Scalar(104., 117., 123.), false, false, CV_32F);
-  }
-  auto rawOutput = engine->infer({{"input", inputData}});
-  faceDetectionImpl::initPrior();
-  std::vector<cv::Rect2d> bbox(inputData.size[0] * topK);
-  std::vector<float> score(inputData.size[0] * topK);
-  std::vector<cv::Mat> landmark(inputData.size[0] * topK);
-  std::size_t curIndex = 0;
-  for (int batch = 0; batch < inputData.size[0]; batch++) {
-    int row = 0, col = 0;
-    if (slide) {
-      row = batch / cols;
-      col = batch % cols;
-    }
-    float *rawBboxData = rawOutput["bbox"].ptr<float>(batch);
-    float *rawScoreData = rawOutput["score"].ptr<float>(batch);
-    float *rawLandmarkData = rawOutput["landmark"].ptr<float>(batch);
-    std::unique_ptr<std::pair<float, int>[]> scoreIndex(
-        new std::pair<float, int>[faceDetectionImpl::OUTPUT_SIZE]);
-    auto scoreIndexPtr = scoreIndex.get();
-    float *rawScoreDataPtr = rawScoreData;
-    for (int i = 0; i < faceDetectionImpl::OUTPUT_SIZE; i++) {
-      scoreIndexPtr->first = *(++rawScoreDataPtr)++;
-      (scoreIndexPtr++)->second = i;
-    }
-    std::sort(
-        scoreIndex.get(), scoreIndexPtr,
+  }
+  if (slotData.size() <= (std::size_t)count) {
+    slotData.resize(count + 1);
+    workspace.allocations++;
+  }
+  auto &inputData = slotData[count];
+  if (inputData.empty()) {
+    inputData = getInputData(inputBuffer, count);
+    workspace.allocations++;
+  }
+  workspace.input[slot]["input"] = inputData;
+  float *inputDataPtr = (float *)inputData.data;
+  for (int i = begin; i < begin + count; i++) {
+    cv::resize(workspace.windows[i], workspace.resized,
+               cv::Size(INPUT_SIZE[0], INPUT_SIZE[1]));
+    cv::split(workspace.resized, workspace.channels);
+    for (int c = 0; c < 3; c++) {
+      cv::Mat plane(INPUT_SIZE[1], INPUT_SIZE[0], CV_32F, inputDataPtr);
+      workspace.channels[c].convertTo(plane, CV_32F, 1., -MEAN[c]);
+      inputDataPtr += planeSize;
+    }
+  }
+}
+
+/**
+ * @brief Get sliding window grid with 50% overlap
+ */
+void getGrid(const cv::Mat &image, int &rows, int &cols) {
+  int halfWidth = std::ceil((double)INPUT_SIZE[1] / 2),
+      halfHeight = std::ceil((double)INPUT_SIZE[0] / 2);
+  rows = (int)std::ceil((double)std::max(image.rows, halfHeight * 2) /
+                        halfHeight) -
+         1;
+  cols = (int)std::ceil((double)std::max(image.cols, halfWidth * 2) /
+                        halfWidth) -
+         1;
+}
+
+/**
+ * @brief Add sliding window (row, col) of grid to workspace windows
+ */
+inline void addGridWindow(Workspace &workspace, const cv::Mat &image,
+                          int imageIndex, int row, int col, int rows,
+                          int cols) {
+  workspace.windowImages.push_back(imageIndex);
+  workspace.windows.push_back(image(
+      cv::Rect(col * image.cols / (cols + 1), row * image.rows / (rows + 1),
+               2 * image.cols / (cols + 1), 2 * image.rows / (rows + 1))));
+  workspace.windowRects.emplace_back((double)col / (cols + 1),
+                                     (double)row / (rows + 1), 2. / (cols + 1),
+                                     2. / (rows + 1));
+}
+
+/**
+ * @brief Add whole image to workspace windows
+ */
+inline void addImageWindow(Workspace &workspace, const cv::Mat &image,
+                           int imageIndex) {
+  workspace.windowImages.push_back(imageIndex);
+  workspace.windows.push_back(image);
+  workspace.windowRects.emplace_back(0., 0., 1., 1.);
+}
+
+/**
+ * @brief Append detections of workspace windows [begin, begin + count),
+ * mapped to the whole image, to workspace bbox, score and landmark
+ */
+void decodeOutput(InferEngine *engine, Workspace &workspace,
+                  const std::unordered_map<std::string, cv::Mat> &rawOutput,
+                  int begin, int count, float nmsThreshold,
+                  float scoreThreshold, int keepBeforeNMS, int topK) {
+  const cv::Mat &rawBbox = rawOutput.at("bbox");
+  const cv::Mat &rawScore = rawOutput.at("score");
+  const cv::Mat &rawLandmark = rawOutput.at("landmark");
+  float bboxScale = engine->getTensorScale("bbox");
+  float scoreScale = engine->getTensorScale("score");
+  float landmarkScale = engine->getTensorScale("landmark");
+  auto &scoreIndex = workspace.scoreIndex;
+  auto &indicesBeforeNMS = workspace.indicesBeforeNMS;
+  auto &bboxBeforeNMS = workspace.bboxBeforeNMS;
+  auto &scoreBeforeNMS = workspace.scoreBeforeNMS;
+  auto &indicesAfterNMS = workspace.indicesAfterNMS;
+  auto &bbox = workspace.bbox;
+  auto &score = workspace.score;
+  reserve(scoreIndex, OUTPUT_SIZE, workspace.allocations);
+  scoreIndex.resize(OUTPUT_SIZE);
+  std::size_t maxSizeBeforeNMS = std::min(keepBeforeNMS, OUTPUT_SIZE);
+  reserve(indicesBeforeNMS, maxSizeBeforeNMS, workspace.allocations);
+  reserve(bboxBeforeNMS, maxSizeBeforeNMS, workspace.allocations);
+  reserve(scoreBeforeNMS, maxSizeBeforeNMS, workspace.allocations);
+  reserve(workspace.landmarkIndices, topK, workspace.allocations);
+  double *landmark = (double *)workspace.landmark.data;
+  for (int batch = 0; batch < count; batch++) {
+    auto &windowRect = workspace.windowRects[begin + batch];
+    auto scoreIndexEnd = filterScore(scoreIndex.data(), rawScore, batch,
+                                     scoreThreshold, scoreScale);
+    std::size_t sizeBeforeNMS =
+        std::min<std::size_t>(keepBeforeNMS, scoreIndexEnd - scoreIndex.data());
+    std::partial_sort(
+        scoreIndex.data(), scoreIndex.data() + sizeBeforeNMS, scoreIndexEnd,
         [](const std::pair<float, int> &a, const std::pair<float, int> &b) {
           if (a.first == b.first) {
             return a.second < b.second;
           }
           return a.first > b.first;
         });
-    std::size_t sizeBeforeNMS =
-        std::min(keepBeforeNMS, faceDetectionImpl::OUTPUT_SIZE);
-    std::vector<int> indicesBeforeNMS(sizeBeforeNMS);
-    std::vector<cv::Rect2d> bboxBeforeNMS(sizeBeforeNMS);
+    indicesBeforeNMS.resize(sizeBeforeNMS);
+    bboxBeforeNMS.resize(sizeBeforeNMS);
     auto bboxBeforeNMSIt = bboxBeforeNMS.begin();
-    std::vector<float> scoreBeforeNMS(sizeBeforeNMS);
+    scoreBeforeNMS.resize(sizeBeforeNMS);
     auto scoreBeforeNMSIt = scoreBeforeNMS.begin();
-    scoreIndexPtr = scoreIndex.get();
+    auto scoreIndexPtr = scoreIndex.data();
     for (int &indexBeforeNMS : indicesBeforeNMS) {
       indexBeforeNMS = scoreIndexPtr->second;
-      faceDetectionImpl::decodeBbox(
-          *bboxBeforeNMSIt++, rawBboxData + indexBeforeNMS * 4,
-          faceDetectionImpl::prior.ptr<double>(indexBeforeNMS));
       *scoreBeforeNMSIt++ = (scoreIndexPtr++)->first;
     }
-    std::vector<int> indicesAfterNMS;
-    cv::dnn::NMSBoxes(bboxBeforeNMS, scoreBeforeNMS, scoreThreshold,
-                      nmsThreshold, indicesAfterNMS, 1.F, topK);
+    const float *rawBboxItem =
+        convertRows(rawBbox, batch, indicesBeforeNMS.data(), sizeBeforeNMS,
+                    4, bboxScale, workspace);
+    for (int indexBeforeNMS : indicesBeforeNMS) {
+      decodeBbox(*bboxBeforeNMSIt++, rawBboxItem,
+                 prior.ptr<double>(indexBeforeNMS));
+      rawBboxItem += 4;
+    }
+    nmsBoxes(bboxBeforeNMS, scoreBeforeNMS, scoreThreshold, nmsThreshold,
+             topK, indicesAfterNMS, workspace);
+    auto &landmarkIndices = workspace.landmarkIndices;
+    landmarkIndices.resize(indicesAfterNMS.size());
+    for (std::size_t i = 0; i < indicesAfterNMS.size(); i++) {
+      landmarkIndices[i] = indicesBeforeNMS[indicesAfterNMS[i]];
+    }
+    const float *rawLandmarkItem =
+        convertRows(rawLandmark, batch, landmarkIndices.data(),
+                    landmarkIndices.size(), 10, landmarkScale, workspace);
     for (int indexAfterNMS : indicesAfterNMS) {
-      bbox[curIndex] = bboxBeforeNMS[indexAfterNMS];
-      faceDetectionImpl::decodeLandmark(
-          landmark[curIndex],
-          rawLandmarkData + indicesBeforeNMS[indexAfterNMS] * 10,
-          faceDetectionImpl::prior.ptr<double>(
-              indicesBeforeNMS[indexAfterNMS]));
-      if (batch < rows * cols) {
-        auto &bboxItem = bbox[curIndex];
-        bboxItem.width *= 2. / (cols + 1);
-        bboxItem.height *= 2. / (rows + 1);
-        bboxItem.x *= 2. / (cols + 1);
-        bboxItem.x += (double)col / (cols + 1);
-        bboxItem.y *= 2. / (rows + 1);
-        bboxItem.y += (double)row / (rows + 1);
-        double *landmarkData = (double *)landmark[curIndex].data;
-        *landmarkData *= 2. / (cols + 1);
-        *landmarkData++ += (double)col / (cols + 1);
-        *landmarkData *= 2. / (rows + 1);
-        *landmarkData++ += (double)row / (rows + 1);
-        *landmarkData *= 2. / (cols + 1);
-        *landmarkData++ += (double)col / (cols + 1);
-        *landmarkData *= 2. / (rows + 1);
-        *landmarkData++ += (double)row / (rows + 1);
-        *landmarkData *= 2. / (cols + 1);
-        *landmarkData++ += (double)col / (cols + 1);
-        *landmarkData *= 2. / (rows + 1);
-        *landmarkData++ += (double)row / (rows + 1);
-        *landmarkData *= 2. / (cols + 1);
-        *landmarkData++ += (double)col / (cols + 1);
-        *landmarkData *= 2. / (rows + 1);
-        *landmarkData++ += (double)row / (rows + 1);
-        *landmarkData *= 2. / (cols + 1);
-        *landmarkData++ += (double)col / (cols + 1);
-        *landmarkData *= 2. / (rows + 1);
-        *landmarkData++ += (double)row / (rows + 1);
+      bbox.push_back(bboxBeforeNMS[indexAfterNMS]);
+      auto &bboxItem = bbox.back();
+      bboxItem.width *= windowRect.width;
+      bboxItem.height *= windowRect.height;
+      bboxItem.x *= windowRect.width;
+      bboxItem.x += windowRect.x;
+      bboxItem.y *= windowRect.height;
+      bboxItem.y += windowRect.y;
+      double *landmarkData = landmark + (bbox.size() - 1) * 10;
+      decodeLandmark(landmarkData, rawLandmarkItem,
+                     prior.ptr<double>(indicesBeforeNMS[indexAfterNMS]));
+      rawLandmarkItem += 10;
+      for (int i = 0; i < 5; i++) {
+        *landmarkData *= windowRect.width;
+        *landmarkData++ += windowRect.x;
+        *landmarkData *= windowRect.height;
+        *landmarkData++ += windowRect.y;
       }
-      score[curIndex++] = scoreBeforeNMS[indexAfterNMS];
+      score.push_back(scoreBeforeNMS[indexAfterNMS]);
+      workspace.bboxImages.push_back(workspace.windowImages[begin + batch]);
     }
   }
-  bbox.resize(curIndex);
-  score.resize(curIndex);
-  landmark.resize(curIndex);
-  std::vector<int> indices;
-  cv::dnn::NMSBoxes(bbox, score, scoreThreshold, nmsThreshold, indices, 1.F,
-                    topK);
-  FaceDetectionResult result = {std::vector<cv::Rect2d>(indices.size()),
-                                std::vector<float>(indices.size()),
-                                std::vector<cv::Mat>(indices.size())};
-  for (int i = 0; i < indices.size(); i++) {
-    result.bbox[i] = bbox[indices[i]];
-    result.score[i] = score[indices[i]];
-    result.landmark[i] = landmark[indices[i]];
-  }
-  return result;
+}
+
+/**
+ * @brief Infer workspace windows and append detections of each window,
+ * mapped to the whole image, to workspace bbox, score and landmark,
+ * windows are inferred in chunks of the engine batch size,
+ * each chunk is decoded while the engine infers the next one,
+ * windows must not be empty
+ */
+void detectWindows(InferEngine *engine, Workspace &workspace,
+                   float nmsThreshold, float scoreThreshold, int keepBeforeNMS,
+                   int topK) {
+  int windowCount = workspace.windows.size();
+  int chunkSize = std::max(engine->getBatchSize(), 1);
+  initPrior();
+  prepareInput(workspace, 0, std::min(chunkSize, windowCount), 0);
+  engine->enqueue(workspace.input[0], workspace.infer);
+  for (int begin = 0, slot = 0; begin < windowCount;
+       begin += chunkSize, slot ^= 1) {
+    int count = std::min(chunkSize, windowCount - begin);
+    int nextCount = std::min(chunkSize, windowCount - begin - count);
+    if (nextCount > 0) {
+      // Preprocess the next chunk while the engine infers this one
+      prepareInput(workspace, begin + count, nextCount, slot ^ 1);
+    }
+    auto &rawOutput = engine->wait(workspace.infer);
+    if (nextCount > 0) {
+      engine->enqueue(workspace.input[slot ^ 1], workspace.infer);
+    }
+    decodeOutput(engine, workspace, rawOutput, begin, count, nmsThreshold,
+                 scoreThreshold, keepBeforeNMS, topK);
+  }
+  workspace.lastWindows += windowCount;
+  workspace.windows.clear();
+  workspace.windowRects.clear();
+  workspace.windowImages.clear();
+}
+
+/**
+ * @brief Add sliding windows around uncertain or small first pass
+ * candidates to workspace windows
+ */
+void addCascadeWindows(Workspace &workspace, const cv::Mat &image,
+                       int imageIndex, int rows, int cols, float scoreThreshold,
+                       const FaceCascadeOptions &cascade) {
+  auto &windowSelected = workspace.windowSelected;
+  reserve(windowSelected, rows * cols, workspace.allocations);
+  windowSelected.assign(rows * cols, 0);
+  int windowCount = 0;
+  for (std::size_t i = 0; i < workspace.bbox.size(); i++) {
+    auto &bboxItem = workspace.bbox[i];
+    if (workspace.bboxImages[i] != imageIndex) {
+      continue;
+    }
+    if (workspace.score[i] >= scoreThreshold &&
+        bboxItem.width * INPUT_SIZE[1] >= cascade.smallFaceSize &&
+        bboxItem.height * INPUT_SIZE[0] >= cascade.smallFaceSize) {
+      continue;
+    }
+    int row = (int)std::lround((bboxItem.y + bboxItem.height / 2.) *
+                               (rows + 1)) -
+              1,
+        col = (int)std::lround((bboxItem.x + bboxItem.width / 2.) *
+                               (cols + 1)) -
+              1;
+    row = std::min(std::max(row, 0), rows - 1);
+    col = std::min(std::max(col, 0), cols - 1);
+    if (windowSelected[row * cols + col]) {
+      continue;
+    }
+    if (cascade.maxWindows > 0 && windowCount >= cascade.maxWindows) {
+      break;
+    }
+    windowSelected[row * cols + col] = 1;
+    addGridWindow(workspace, image, imageIndex, row, col, rows, cols);
+    windowCount++;
+  }
+}
+
+/**
+ * @brief Least squares similarity transform from 5 landmarks
+ * (normalized to image) to alignment template (scaled to size)
+ */
+void estimateSimilarity(double *transform, const cv::Mat &landmarkItem,
+                        int cols, int rows, double scale) {
+  double src[5][2], dst[5][2];
+  double srcMean[2] = {0., 0.}, dstMean[2] = {0., 0.};
+  for (int i = 0; i < 5; i++) {
+    src[i][0] = landmarkItem.at<double>(i, 0) * cols;
+    src[i][1] = landmarkItem.at<double>(i, 1) * rows;
+    dst[i][0] = ALIGN_TEMPLATE[i][0] * scale;
+    dst[i][1] = ALIGN_TEMPLATE[i][1] * scale;
+    srcMean[0] += src[i][0] / 5.;
+    srcMean[1] += src[i][1] / 5.;
+    dstMean[0] += dst[i][0] / 5.;
+    dstMean[1] += dst[i][1] / 5.;
+  }
+  double a = 0., b = 0., var = 0.;
+  for (int i = 0; i < 5; i++) {
+    double sx = src[i][0] - srcMean[0], sy = src[i][1] - srcMean[1];
+    double dx = dst[i][0] - dstMean[0], dy = dst[i][1] - dstMean[1];
+    a += sx * dx + sy * dy;
+    b += sx * dy - sy * dx;
+    var += sx * sx + sy * sy;
+  }
+  double c = var > 0. ? a / var : 1., d = var > 0. ? b / var : 0.;
+  transform[0] = c;
+  transform[1] = -d;
+  transform[2] = dstMean[0] - c * srcMean[0] + d * srcMean[1];
+  transform[3] = d;
+  transform[4] = c;
+  transform[5] = dstMean[1] - d * srcMean[0] - c * srcMean[1];
+}
+
+/**
+ * @brief Perform face detection on images, windows of all images are
+ * inferred together, results are stored in workspace results
+ */
+void detectImages(InferEngine *engine, const cv::Mat *images, int imageCount,
+                  Workspace &workspace, FaceDetectionMode mode,
+                  float nmsThreshold, float scoreThreshold, int keepBeforeNMS,
+                  int topK, const FaceCascadeOptions &cascade) {
+  int maxWindows = 0;
+  for (int k = 0; k < imageCount; k++) {
+    int rows = 0, cols = 0;
+    getGrid(images[k], rows, cols);
+    maxWindows += mode == FaceDetectionMode::RESIZE ? 1 : rows * cols + 1;
+  }
+  reserve(workspace.windows, maxWindows, workspace.allocations);
+  reserve(workspace.windowRects, maxWindows, workspace.allocations);
+  reserve(workspace.windowImages, maxWindows, workspace.allocations);
+  reserve(workspace.bbox, maxWindows * topK, workspace.allocations);
+  reserve(workspace.score, maxWindows * topK, workspace.allocations);
+  reserve(workspace.bboxImages, maxWindows * topK, workspace.allocations);
+  reserve(workspace.landmark, maxWindows * topK * 10, CV_64F,
+          workspace.allocations);
+  workspace.bbox.clear();
+  workspace.score.clear();
+  workspace.bboxImages.clear();
+  workspace.lastWindows = 0;
+  for (int k = 0; k < imageCount; k++) {
+    if (mode == FaceDetectionMode::SLIDE) {
+      int rows = 0, cols = 0;
+      getGrid(images[k], rows, cols);
+      for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+          addGridWindow(workspace, images[k], k, i, j, rows, cols);
+        }
+      }
+    }
+    addImageWindow(workspace, images[k], k);
+  }
+  if (mode == FaceDetectionMode::CASCADE) {
+    detectWindows(engine, workspace, nmsThreshold,
+                  std::min(cascade.candidateThreshold, scoreThreshold),
+                  keepBeforeNMS, topK);
+    for (int k = 0; k < imageCount; k++) {
+      if (images[k].rows > INPUT_SIZE[0] || images[k].cols > INPUT_SIZE[1]) {
+        int rows = 0, cols = 0;
+        getGrid(images[k], rows, cols);
+        addCascadeWindows(workspace, images[k], k, rows, cols,
+                          scoreThreshold, cascade);
+      }
+    }
+    if (!workspace.windows.empty()) {
+      detectWindows(engine, workspace, nmsThreshold, scoreThreshold,
+                    keepBeforeNMS, topK);
+    }
+  } else {
+    detectWindows(engine, workspace, nmsThreshold, scoreThreshold,
+                  keepBeforeNMS, topK);
+  }
+  auto &results = workspace.results;
+  if (results.size() < (std::size_t)imageCount) {
+    results.resize(imageCount);
+    workspace.allocations++;
+  }
+  reserve(workspace.imageBbox, workspace.bbox.size(), workspace.allocations);
+  reserve(workspace.imageScore, workspace.bbox.size(), workspace.allocations);
+  reserve(workspace.imageIndices, workspace.bbox.size(),
+          workspace.allocations);
+  for (int k = 0; k < imageCount; k++) {
+    auto &imageBbox = workspace.imageBbox;
+    auto &imageScore = workspace.imageScore;
+    auto &imageIndices = workspace.imageIndices;
+    imageBbox.clear();
+    imageScore.clear();
+    imageIndices.clear();
+    for (std::size_t i = 0; i < workspace.bbox.size(); i++) {
+      if (workspace.bboxImages[i] == k) {
+        imageBbox.push_back(workspace.bbox[i]);
+        imageScore.push_back(workspace.score[i]);
+        imageIndices.push_back(i);
+      }
+    }
+    auto &indices = workspace.indices;
+    nmsBoxes(imageBbox, imageScore, scoreThreshold, nmsThreshold, topK,
+             indices, workspace);
+    auto &result = results[k];
+    reserve(result.bbox, topK, workspace.allocations);
+    reserve(result.score, topK, workspace.allocations);
+    reserve(result.landmark, topK, workspace.allocations);
+    result.bbox.resize(indices.size());
+    result.score.resize(indices.size());
+    result.landmark.resize(indices.size());
+    for (int i = 0; i < indices.size(); i++) {
+      int index = imageIndices[indices[i]];
+      result.bbox[i] = workspace.bbox[index];
+      result.score[i] = workspace.score[index];
+      result.landmark[i] =
+          workspace.landmark.colRange(index * 10, index * 10 + 10)
+              .reshape(1, 5);
+    }
+  }
+}
+} // namespace faceDetectionImpl
+
+InferEngine *
+createFaceDetector(const std::string &engineFilePath, int batchSize,
+                   nvinfer1::ILogger::Severity logLevel,
+                   const std::unordered_map<std::string, float> &outputScale) {
+  std::ifstream engineFile(engineFilePath, std::ios::binary);
+  engineFile.seekg(0, std::ifstream::end);
+  auto engineFileSize = engineFile.tellg();
+  engineFile.seekg(0, std::ifstream::beg);
+  std::unique_ptr<char[]> engineData(new char[engineFileSize]);
+  engineFile.read(engineData.get(), engineFileSize);
+  std::unique_ptr<InferEngine> engine(
+      new InferEngine(engineData.get(), engineFileSize,
+                      {{"input",
+                        {3, faceDetectionImpl::INPUT_SIZE[0],
+                         faceDetectionImpl::INPUT_SIZE[1]}}},
+                      {{"bbox", {faceDetectionImpl::OUTPUT_SIZE, 4}},
+                       {"score", {faceDetectionImpl::OUTPUT_SIZE, 2}},
+                       {"landmark", {faceDetectionImpl::OUTPUT_SIZE, 10}}},
+                      batchSize, logLevel));
+  for (auto name : {"bbox", "score", "landmark"}) {
+    auto scale = outputScale.find(name);
+    if (scale != outputScale.end()) {
+      engine->setTensorScale(name, scale->second);
+    } else if (engine->getTensorDataType(name) ==
+               nvinfer1::DataType::kINT8) {
+      // Raw INT8 values as scores would pass any threshold
+      throw std::invalid_argument(std::string("INT8 output ") + name +
+                                  " of " + engineFilePath +
+                                  " needs a quantization scale");
+    }
+  }
+  return engine.release();
+}
+
+std::unordered_map<std::string, float>
+parseOutputScale(const std::string &text) {
+  std::unordered_map<std::string, float> outputScale;
+  std::stringstream stream(text);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    auto separator = item.find('=');
+    auto name = item.substr(0, separator);
+    std::size_t parsed = 0;
+    float scale = 0.F;
+    if (separator != std::string::npos) {
+      try {
+        scale = std::stof(item.substr(separator + 1), &parsed);
+      } catch (const std::exception &) {
+      }
+    }
+    if ((name != "bbox" && name != "score" && name != "landmark") ||
+        !parsed || parsed != item.size() - separator - 1 || !(scale > 0.F)) {
+      throw std::invalid_argument("Invalid output scale " + item);
+    }
+    outputScale[name] = scale;
+  }
+  return outputScale;
+}
+
+FaceDetectionResult faceDetection(InferEngine *engine, const cv::Mat &image,
+                                  FaceDetectionMode mode, float nmsThreshold,
+                                  float scoreThreshold, int keepBeforeNMS,
+                                  int topK, const FaceCascadeOptions &cascade) {
+  FaceDetectionWorkspace workspace;
+  return faceDetection(engine, image, workspace, mode, nmsThreshold,
+                       scoreThreshold, keepBeforeNMS, topK, cascade);
+}
+
+FaceDetectionWorkspace::FaceDetectionWorkspace()
+    : impl(new faceDetectionImpl::Workspace()) {}
+
+FaceDetectionWorkspace::~FaceDetectionWorkspace() {}
+
+std::uint64_t FaceDetectionWorkspace::getAllocations() const {
+  return impl->allocations + impl->infer.getAllocations();
+}
+
+const FaceDetectionResult &
+faceDetection(InferEngine *engine, const cv::Mat &image,
+              FaceDetectionWorkspace &workspace, FaceDetectionMode mode,
+              float nmsThreshold, float scoreThreshold, int keepBeforeNMS,
+              int topK, const FaceCascadeOptions &cascade) {
+  auto &impl = faceDetectionImpl::getWorkspace(workspace);
+  auto allocations = workspace.getAllocations();
+  faceDetectionImpl::detectImages(engine, &image, 1, impl, mode, nmsThreshold,
+                                  scoreThreshold, keepBeforeNMS, topK,
+                                  cascade);
+  workspace.lastWindows = impl.lastWindows;
+  workspace.lastAllocations = workspace.getAllocations() - allocations;
+  return impl.results[0];
+}
+
+const std::vector<FaceDetectionResult> &
+faceDetection(InferEngine *engine, const std::vector<cv::Mat> &images,
+              FaceDetectionWorkspace &workspace, FaceDetectionMode mode,
+              float nmsThreshold, float scoreThreshold, int keepBeforeNMS,
+              int topK, const FaceCascadeOptions &cascade) {
+  auto &impl = faceDetectionImpl::getWorkspace(workspace);
+  auto allocations = workspace.getAllocations();
+  if (images.empty()) {
+    impl.results.clear();
+    workspace.lastWindows = 0;
+    workspace.lastAllocations = 0;
+    return impl.results;
+  }
+  faceDetectionImpl::detectImages(engine, images.data(), images.size(), impl,
+                                  mode, nmsThreshold, scoreThreshold,
+                                  keepBeforeNMS, topK, cascade);
+  impl.results.resize(images.size());
+  workspace.lastWindows = impl.lastWindows;
+  workspace.lastAllocations = workspace.getAllocations() - allocations;
+  return impl.results;
+}
+
+void alignFaces(const cv::Mat &image, const FaceDetectionResult &result,
+                int size, cv::Mat &crops) {
+  int faceCount = result.landmark.size();
+  crops.create(faceCount * size, size, image.type());
+  if (!faceCount) {
+    return;
+  }
+  cv::Mat transforms(faceCount * 2, 3, CV_64F);
+  for (int i = 0; i < faceCount; i++) {
+    faceDetectionImpl::estimateSimilarity(
+        transforms.ptr<double>(i * 2), result.landmark[i], image.cols,
+        image.rows, size / faceDetectionImpl::ALIGN_SIZE);
+  }
+  cv::parallel_for_(cv::Range(0, faceCount), [&](const cv::Range &range) {
+    for (int i = range.start; i < range.end; i++) {
+      cv::Mat crop = crops.rowRange(i * size, (i + 1) * size);
+      cv::warpAffine(image, crop, transforms.rowRange(i * 2, (i + 1) * 2),
+                     cv::Size(size, size), cv::INTER_LINEAR,
+                     cv::BORDER_CONSTANT);
+    }
+  });
 }
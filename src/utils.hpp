@@ -1,7 +1,13 @@
 #ifndef PROJECT_SRC_UTILS_HPP_
 #define PROJECT_SRC_UTILS_HPP_
 
+#include <cstdint>
+
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <NvInfer.h>
 #include <opencv2/core.hpp>
@@ -26,6 +32,106 @@ struct FaceDetectionResult {
   std::vector<cv::Mat> landmark;
 };
 
+/**
+ * @brief Face detection mode
+ */
+enum class FaceDetectionMode {
+  /**
+   * @brief Resize image to fit input size
+   */
+  RESIZE,
+  /**
+   * @brief Sliding window to maintain original resolution,
+   * plus the resized image, may increase inference time
+   */
+  SLIDE,
+  /**
+   * @brief Coarse-to-fine detection, resized image first,
+   * then sliding windows only around uncertain or small candidates
+   */
+  CASCADE,
+};
+
+/**
+ * @brief Options of FaceDetectionMode::CASCADE,
+ * lower candidateThreshold or higher smallFaceSize and maxWindows
+ * trade latency for recall, the defaults refine at most 8 windows per
+ * image, SLIDE infers 67 windows for 3840 x 2160,
+ * the defaults are provisional, not yet backed by recall or latency
+ * measurements, compare modes with sh/run_benchmark.sh before relying on
+ * them
+ */
+struct FaceCascadeOptions {
+  /**
+   * @brief Minimum score of a first pass candidate to be considered,
+   * candidates below scoreThreshold are refined by sliding windows
+   */
+  float candidateThreshold = .3F;
+  /**
+   * @brief First pass faces smaller than this size in pixels of
+   * the resized input are refined by sliding windows
+   */
+  double smallFaceSize = 32.;
+  /**
+   * @brief Maximum number of sliding windows per image, 0 for no limit,
+   * candidates are visited by descending score
+   */
+  int maxWindows = 8;
+};
+
+class FaceDetectionWorkspace;
+
+namespace faceDetectionImpl {
+struct Workspace;
+Workspace &getWorkspace(FaceDetectionWorkspace &workspace);
+} // namespace faceDetectionImpl
+
+/**
+ * @class FaceDetectionWorkspace
+ * @brief Reusable scratch memory for face detection,
+ * buffers grow to the largest request seen and are kept until the
+ * workspace is destroyed, input blobs hold 2 engine batches of windows
+ * (4.9 MB per window) regardless of image size or number of images,
+ * keep one workspace per thread, e.g. thread_local
+ */
+class FaceDetectionWorkspace {
+public:
+  /**
+   * @brief Constructor
+   */
+  FaceDetectionWorkspace();
+  /**
+   * @brief Destructor
+   */
+  ~FaceDetectionWorkspace();
+  FaceDetectionWorkspace(const FaceDetectionWorkspace &) = delete;
+  FaceDetectionWorkspace &operator=(const FaceDetectionWorkspace &) = delete;
+
+  /**
+   * @brief Number of workspace buffer (re)allocations made by the last call,
+   * including infer, 0 for steady-state requests,
+   * temporaries allocated inside OpenCV (cv::resize, cv::split,
+   * cv::parallel_for_) and by the caller are not counted
+   */
+  std::uint64_t lastAllocations = 0;
+  /**
+   * @brief Number of windows inferred by the last call
+   */
+  int lastWindows = 0;
+
+  /**
+   * @brief Get total number of workspace buffer (re)allocations,
+   * including infer
+   */
+  std::uint64_t getAllocations() const;
+
+private:
+  friend faceDetectionImpl::Workspace &
+  faceDetectionImpl::getWorkspace(FaceDetectionWorkspace &workspace);
+
+  std::unique_ptr<faceDetectionImpl::Workspace> impl;
+};
+
 /**
  * @brief Create TensorRT inference engine for face detection
  * @param engineFilePath
@@ -35,24 +141,41 @@ struct FaceDetectionResult {
  * @param logLevel
  * Log level for TensorRT logger,
  * refer to nvinfer1::ILogger::Severity
+ * @param outputScale
+ * Quantization scale of INT8 outputs("bbox", "score", "landmark"),
+ * required for every INT8 output, ignored for FP32 and FP16 outputs
  * @return
- * Pointer to InferEngine
+ * Pointer to InferEngine,
+ * throws std::invalid_argument if an INT8 output has no scale
+ */
+InferEngine *createFaceDetector(
+    const std::string &engineFilePath, int batchSize = 1,
+    nvinfer1::ILogger::Severity logLevel =
+        nvinfer1::ILogger::Severity::kWARNING,
+    const std::unordered_map<std::string, float> &outputScale = {});
+
+/**
+ * @brief Parse quantization scales of INT8 outputs for createFaceDetector
+ * @param text
+ * Comma separated name=scale, e.g. "bbox=0.01,score=0.004,landmark=0.02",
+ * real value = quantized value * scale
+ * @return
+ * Output name and scale, empty if text is empty,
+ * throws std::invalid_argument if an item is invalid
  */
-InferEngine *createFaceDetector(const std::string &engineFilePath,
-                                int batchSize = 1,
-                                nvinfer1::ILogger::Severity logLevel =
-                                    nvinfer1::ILogger::Severity::kWARNING);
+std::unordered_map<std::string, float>
+parseOutputScale(const std::string &text);
 
 /**
- * @brief Perform face detection
+ * @brief Perform face detection,
+ * outputs of engine can be FP32, FP16 or INT8
  * @param engine
  * Pointer to InferEngine
  * @param image
  * Input image
- * @param slide
- * Use sliding window to maintain original resolution,
- * otherwise resize image to fit input size,
- * enable this option may increase inference time
+ * @param mode
+ * Face detection mode,
+ * refer to FaceDetectionMode
  * @param nmsThreshold
  * Non-maximum suppression threshold
  * @param scoreThreshold
@@ -61,12 +184,101 @@ InferEngine *createFaceDetector(const std::string &engineFilePath,
  * Number of bounding boxes to keep before non-maximum suppression
  * @param topK
  * Number of bounding boxes to keep finally
+ * @param cascade
+ * Options of FaceDetectionMode::CASCADE
  * @return
  * Face detection result
  */
-FaceDetectionResult faceDetection(InferEngine *engine, const cv::Mat &image,
-                                  bool slide = false, float nmsThreshold = .5F,
-                                  float scoreThreshold = .5F,
-                                  int keepBeforeNMS = 1000, int topK = 100);
+FaceDetectionResult
+faceDetection(InferEngine *engine, const cv::Mat &image,
+              FaceDetectionMode mode = FaceDetectionMode::RESIZE,
+              float nmsThreshold = .5F, float scoreThreshold = .5F,
+              int keepBeforeNMS = 1000, int topK = 100,
+              const FaceCascadeOptions &cascade = FaceCascadeOptions());
+
+/**
+ * @brief Perform face detection with reusable workspace,
+ * outputs of engine can be FP32, FP16 or INT8
+ * @param engine
+ * Pointer to InferEngine
+ * @param image
+ * Input image
+ * @param workspace
+ * Workspace reused across calls on the same thread
+ * @param mode
+ * Face detection mode,
+ * refer to FaceDetectionMode
+ * @param nmsThreshold
+ * Non-maximum suppression threshold
+ * @param scoreThreshold
+ * Confidence score threshold
+ * @param keepBeforeNMS
+ * Number of bounding boxes to keep before non-maximum suppression
+ * @param topK
+ * Number of bounding boxes to keep finally
+ * @param cascade
+ * Options of FaceDetectionMode::CASCADE
+ * @return
+ * Face detection result stored in workspace,
+ * valid until next call with the same workspace
+ */
+const FaceDetectionResult &
+faceDetection(InferEngine *engine, const cv::Mat &image,
+              FaceDetectionWorkspace &workspace,
+              FaceDetectionMode mode = FaceDetectionMode::RESIZE,
+              float nmsThreshold = .5F, float scoreThreshold = .5F,
+              int keepBeforeNMS = 1000, int topK = 100,
+              const FaceCascadeOptions &cascade = FaceCascadeOptions());
+
+/**
+ * @brief Perform face detection on multiple images with reusable workspace,
+ * windows of all images are inferred in the same batches
+ * @param engine
+ * Pointer to InferEngine
+ * @param images
+ * Input images, must not be empty
+ * @param workspace
+ * Workspace reused across calls on the same thread
+ * @param mode
+ * Face detection mode,
+ * refer to FaceDetectionMode
+ * @param nmsThreshold
+ * Non-maximum suppression threshold
+ * @param scoreThreshold
+ * Confidence score threshold
+ * @param keepBeforeNMS
+ * Number of bounding boxes to keep before non-maximum suppression
+ * @param topK
+ * Number of bounding boxes to keep finally for each image
+ * @param cascade
+ * Options of FaceDetectionMode::CASCADE
+ * @return
+ * Face detection results, one per image, stored in workspace,
+ * valid until next call with the same workspace
+ */
+const std::vector<FaceDetectionResult> &
+faceDetection(InferEngine *engine, const std::vector<cv::Mat> &images,
+              FaceDetectionWorkspace &workspace,
+              FaceDetectionMode mode = FaceDetectionMode::RESIZE,
+              float nmsThreshold = .5F, float scoreThreshold = .5F,
+              int keepBeforeNMS = 1000, int topK = 100,
+              const FaceCascadeOptions &cascade = FaceCascadeOptions());
+
+/**
+ * @brief Align faces by similarity transform from 5 landmarks
+ * to the ArcFace template, all faces are warped into one buffer
+ * @param image
+ * Input image of face detection
+ * @param result
+ * Face detection result of image
+ * @param size
+ * Side length of aligned face crops, template is scaled from 112 x 112
+ * @param crops
+ * Output aligned faces, (N * size) x size with type of image,
+ * face i is crops.rowRange(i * size, (i + 1) * size),
+ * reused if already allocated with the same size
+ */
+void alignFaces(const cv::Mat &image, const FaceDetectionResult &result,
+                int size, cv::Mat &crops);
 
 #endif
\ No newline at end of file
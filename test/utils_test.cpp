@@ -0,0 +1,372 @@
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "engine.hpp"
+#include "utils.hpp"
+
+/**
+ * @brief Number of anchors of 640 x 640 input, same as utils.cpp
+ */
+static const int OUTPUT_SIZE = 16800;
+/**
+ * @brief Quantization scale of synthetic outputs,
+ * values q * SCALE are exact in FP32, FP16 and INT8 (q)
+ */
+static const float SCALE = 1.F / 64;
+
+/**
+ * @class SyntheticEngine
+ * @brief InferEngine returning fixed outputs for every window
+ */
+class SyntheticEngine : public InferEngine {
+public:
+  SyntheticEngine(const std::unordered_map<std::string, cv::Mat> &window,
+                  int depth, int batchSize = 1)
+      : InferEngine(batchSize) {
+    for (auto &nameMat : window) {
+      nameMat.second.convertTo(this->window[nameMat.first], depth,
+                               depth == CV_8S ? 1. / SCALE : 1.);
+      if (depth == CV_8S) {
+        setTensorScale(nameMat.first, SCALE);
+      }
+    }
+  }
+
+  void enqueue(const std::unordered_map<std::string, cv::Mat> &input,
+               InferWorkspace &) override {
+    int batchSize = input.at("input").size[0];
+    // Outputs of the previous enqueue stay readable, as in InferEngine
+    slot ^= 1;
+    for (auto &nameMat : window) {
+      auto &windowOutput = nameMat.second;
+      int sizes[] = {batchSize, windowOutput.rows, windowOutput.cols};
+      auto &batchOutput = output[slot][nameMat.first];
+      batchOutput.create(3, sizes, windowOutput.type());
+      for (int batch = 0; batch < batchSize; batch++) {
+        cv::Mat batchWindow(windowOutput.rows, windowOutput.cols,
+                            windowOutput.type(), batchOutput.ptr(batch));
+        windowOutput.copyTo(batchWindow);
+      }
+    }
+  }
+
+  const std::unordered_map<std::string, cv::Mat> &
+  wait(InferWorkspace &) override {
+    return output[slot];
+  }
+
+private:
+  std::unordered_map<std::string, cv::Mat> window;
+  std::unordered_map<std::string, cv::Mat> output[2];
+  int slot = 0;
+};
+
+/**
+ * @brief FP32 outputs of one window, every value is q * SCALE
+ */
+std::unordered_map<std::string, cv::Mat> createWindowOutput() {
+  std::mt19937 random(20240601);
+  std::uniform_int_distribution<int> bboxValue(-64, 64);
+  std::uniform_int_distribution<int> landmarkValue(-127, 127);
+  std::uniform_int_distribution<int> scoreValue(16, 64);
+  std::uniform_int_distribution<int> anchor(0, OUTPUT_SIZE - 1);
+  cv::Mat bbox(OUTPUT_SIZE, 4, CV_32F), score(OUTPUT_SIZE, 2, CV_32F),
+      landmark(OUTPUT_SIZE, 10, CV_32F);
+  for (int i = 0; i < OUTPUT_SIZE; i++) {
+    for (int j = 0; j < 4; j++) {
+      bbox.at<float>(i, j) = bboxValue(random) * SCALE;
+    }
+    for (int j = 0; j < 10; j++) {
+      landmark.at<float>(i, j) = landmarkValue(random) * SCALE;
+    }
+    score.at<float>(i, 0) = 1.F;
+    score.at<float>(i, 1) = 0.F;
+  }
+  for (int i = 0; i < 400; i++) {
+    int index = anchor(random);
+    int value = scoreValue(random);
+    score.at<float>(index, 0) = 1.F - value * SCALE;
+    score.at<float>(index, 1) = value * SCALE;
+  }
+  return {{"bbox", bbox}, {"score", score}, {"landmark", landmark}};
+}
+
+bool near(double a, double b) { return std::abs(a - b) <= 1e-9; }
+
+/**
+ * @brief Compare result with FP32 result
+ * @return
+ * Number of mismatches
+ */
+int compare(const std::string &name, const FaceDetectionResult &expected,
+            const FaceDetectionResult &actual) {
+  if (expected.bbox.size() != actual.bbox.size() ||
+      expected.score.size() != actual.score.size() ||
+      expected.landmark.size() != actual.landmark.size()) {
+    std::cerr << name << ": detected " << actual.bbox.size()
+              << " faces, expected " << expected.bbox.size() << std::endl;
+    return 1;
+  }
+  int mismatches = 0;
+  for (std::size_t i = 0; i < expected.bbox.size(); i++) {
+    auto &a = expected.bbox[i], &b = actual.bbox[i];
+    bool same = near(a.x, b.x) && near(a.y, b.y) && near(a.width, b.width) &&
+                near(a.height, b.height) &&
+                near(expected.score[i], actual.score[i]);
+    for (int j = 0; j < 5; j++) {
+      for (int k = 0; k < 2; k++) {
+        same = same && near(expected.landmark[i].at<double>(j, k),
+                            actual.landmark[i].at<double>(j, k));
+      }
+    }
+    if (!same) {
+      std::cerr << name << ": face " << i << " differs" << std::endl;
+      mismatches++;
+    }
+  }
+  return mismatches;
+}
+
+/**
+ * @brief Check that a second call on the same image makes no workspace
+ * allocations
+ * @return
+ * Number of failures
+ */
+int checkSteadyState(const std::string &name, InferEngine *engine,
+                     const cv::Mat &image, FaceDetectionMode mode) {
+  FaceDetectionWorkspace workspace;
+  faceDetection(engine, image, workspace, mode);
+  faceDetection(engine, image, workspace, mode);
+  if (workspace.lastAllocations) {
+    std::cerr << name << ": " << workspace.lastAllocations
+              << " allocations in steady state" << std::endl;
+    return 1;
+  }
+  std::cout << name << ": " << workspace.lastWindows
+            << " windows, no allocations in steady state" << std::endl;
+  return 0;
+}
+
+/**
+ * @brief Anchor index of prior (i, j) with min size l of feature map k,
+ * same order as utils.cpp
+ */
+int anchorIndex(int k, int l, int i, int j) {
+  static const int OFFSETS[] = {0, 80 * 80 * 2, 80 * 80 * 2 + 40 * 40 * 2},
+                   SIZES[] = {80, 40, 20};
+  return OFFSETS[k] + (i * SIZES[k] + j) * 2 + l;
+}
+
+/**
+ * @brief FP32 outputs of one window with faces at given anchors only,
+ * raw bbox and landmark are 0 so faces are the priors
+ */
+std::unordered_map<std::string, cv::Mat>
+createTargetOutput(const std::vector<std::pair<int, float>> &anchorScores) {
+  cv::Mat bbox(OUTPUT_SIZE, 4, CV_32F, cv::Scalar::all(0)),
+      score(OUTPUT_SIZE, 2, CV_32F, cv::Scalar::all(0)),
+      landmark(OUTPUT_SIZE, 10, CV_32F, cv::Scalar::all(0));
+  score.col(0).setTo(1.F);
+  for (auto &anchorScore : anchorScores) {
+    score.at<float>(anchorScore.first, 0) = 1.F - anchorScore.second;
+    score.at<float>(anchorScore.first, 1) = anchorScore.second;
+  }
+  return {{"bbox", bbox}, {"score", score}, {"landmark", landmark}};
+}
+
+/**
+ * @brief Sort faces by score, then position, to compare results of
+ * different window orders
+ */
+FaceDetectionResult sortFaces(const FaceDetectionResult &result) {
+  std::vector<int> order(result.bbox.size());
+  for (std::size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&](int a, int b) {
+    auto &bboxA = result.bbox[a], &bboxB = result.bbox[b];
+    return std::make_tuple(-result.score[a], bboxA.x, bboxA.y, bboxA.width,
+                           bboxA.height) <
+           std::make_tuple(-result.score[b], bboxB.x, bboxB.y, bboxB.width,
+                           bboxB.height);
+  });
+  FaceDetectionResult sorted;
+  for (int i : order) {
+    sorted.bbox.push_back(result.bbox[i]);
+    sorted.score.push_back(result.score[i]);
+    sorted.landmark.push_back(result.landmark[i]);
+  }
+  return sorted;
+}
+
+/**
+ * @brief Check CASCADE windows of a 1920 x 1080 image, grid 5 x 3,
+ * engine faces are at the priors of createTargetOutput
+ * @param windows
+ * Expected (row, col) of refined windows
+ * @return
+ * Number of failures
+ */
+int checkCascadeWindows(const std::string &name, InferEngine *engine,
+                        const FaceCascadeOptions &cascade,
+                        const std::vector<std::pair<int, int>> &windows) {
+  const int rows = 3, cols = 5;
+  cv::Mat image(1080, 1920, CV_8UC3, cv::Scalar::all(0));
+  // The image window covers the whole image, its faces are window faces
+  auto windowFaces = faceDetection(engine, image, FaceDetectionMode::RESIZE);
+  FaceDetectionWorkspace workspace;
+  auto result = faceDetection(engine, image, workspace,
+                              FaceDetectionMode::CASCADE, .5F, .5F, 1000, 100,
+                              cascade);
+  if (workspace.lastWindows != (int)windows.size() + 1) {
+    std::cerr << name << ": " << workspace.lastWindows
+              << " windows, expected " << windows.size() + 1 << std::endl;
+    return 1;
+  }
+  // Final NMS keeps the first pass faces and faces of every refined window
+  std::vector<cv::Rect2d> expected(windowFaces.bbox);
+  for (auto &window : windows) {
+    cv::Rect2d windowRect((double)window.second / (cols + 1),
+                          (double)window.first / (rows + 1), 2. / (cols + 1),
+                          2. / (rows + 1));
+    for (auto &bboxItem : windowFaces.bbox) {
+      expected.emplace_back(bboxItem.x * windowRect.width + windowRect.x,
+                            bboxItem.y * windowRect.height + windowRect.y,
+                            bboxItem.width * windowRect.width,
+                            bboxItem.height * windowRect.height);
+    }
+  }
+  int failures = 0;
+  if (result.bbox.size() != expected.size()) {
+    std::cerr << name << ": detected " << result.bbox.size()
+              << " faces, expected " << expected.size() << std::endl;
+    failures++;
+  }
+  for (auto &expectedItem : expected) {
+    bool found = false;
+    for (auto &bboxItem : result.bbox) {
+      found = found ||
+              (near(expectedItem.x, bboxItem.x) &&
+               near(expectedItem.y, bboxItem.y) &&
+               near(expectedItem.width, bboxItem.width) &&
+               near(expectedItem.height, bboxItem.height));
+    }
+    if (!found) {
+      std::cerr << name << ": face at (" << expectedItem.x << ", "
+                << expectedItem.y << ") not detected" << std::endl;
+      failures++;
+    }
+  }
+  if (!failures) {
+    std::cout << name << ": " << workspace.lastWindows << " windows, "
+              << result.bbox.size() << " faces" << std::endl;
+  }
+  return failures;
+}
+
+int main() {
+  auto windowOutput = createWindowOutput();
+  SyntheticEngine fp32Engine(windowOutput, CV_32F);
+  SyntheticEngine fp16Engine(windowOutput, CV_16F);
+  SyntheticEngine int8Engine(windowOutput, CV_8S);
+  SyntheticEngine chunkedEngine(windowOutput, CV_32F, 4);
+  std::vector<std::pair<std::string, cv::Mat>> images = {
+      {"resize", cv::Mat(640, 640, CV_8UC3, cv::Scalar::all(0))},
+      {"slide", cv::Mat(1080, 1920, CV_8UC3, cv::Scalar::all(0))}};
+  int failures = 0;
+  // Engine batch 4 with partial chunks: RESIZE and the first CASCADE pass
+  // infer 1 window, SLIDE infers 6 x 3 + 1 = 19 windows
+  cv::Mat steadyImage(1080, 2240, CV_8UC3, cv::Scalar::all(0));
+  failures += checkSteadyState("resize steady state", &chunkedEngine,
+                               steadyImage, FaceDetectionMode::RESIZE);
+  failures += checkSteadyState("slide steady state", &chunkedEngine,
+                               steadyImage, FaceDetectionMode::SLIDE);
+  failures += checkSteadyState("cascade steady state", &chunkedEngine,
+                               steadyImage, FaceDetectionMode::CASCADE);
+  // 16 px faces at the top left and at (0.63, 0.63) are small, a confident
+  // 512 px face is kept, an uncertain one at the bottom right is refined,
+  // (0.63, 0.63) rounds to window (2, 3), windows out of the grid are
+  // clamped to (0, 0) and (2, 4)
+  SyntheticEngine targetEngine(
+      createTargetOutput({{anchorIndex(0, 0, 0, 0), 1.F},
+                          {anchorIndex(0, 0, 50, 50), 1.F},
+                          {anchorIndex(2, 1, 10, 19), 1.F},
+                          {anchorIndex(2, 1, 19, 19), .375F}}),
+      CV_32F);
+  FaceCascadeOptions cascade;
+  failures += checkCascadeWindows("cascade", &targetEngine, cascade,
+                                  {{0, 0}, {2, 3}, {2, 4}});
+  cascade.maxWindows = 2;
+  failures += checkCascadeWindows("cascade max windows", &targetEngine,
+                                  cascade, {{0, 0}, {2, 3}});
+  cascade = FaceCascadeOptions();
+  cascade.smallFaceSize = 0.;
+  failures += checkCascadeWindows("cascade no small faces", &targetEngine,
+                                  cascade, {{2, 4}});
+  cascade = FaceCascadeOptions();
+  cascade.candidateThreshold = .5F;
+  failures += checkCascadeWindows("cascade no uncertain faces",
+                                  &targetEngine, cascade, {{0, 0}, {2, 3}});
+  // Refining every candidate without limit infers the SLIDE windows,
+  // every window has the same scores so NMS of equal scores depends on
+  // window order, compare all detections without suppression instead
+  cascade = FaceCascadeOptions();
+  cascade.candidateThreshold = .5F;
+  cascade.smallFaceSize = 1e9;
+  cascade.maxWindows = 0;
+  FaceDetectionWorkspace slideWorkspace, cascadeWorkspace;
+  auto slideResult = sortFaces(
+      faceDetection(&fp32Engine, images[1].second, slideWorkspace,
+                    FaceDetectionMode::SLIDE, 1.F, .5F, 1000, 10000));
+  auto cascadeResult = sortFaces(faceDetection(
+      &fp32Engine, images[1].second, cascadeWorkspace,
+      FaceDetectionMode::CASCADE, 1.F, .5F, 1000, 10000, cascade));
+  if (cascadeWorkspace.lastWindows != slideWorkspace.lastWindows) {
+    std::cerr << "cascade without limit: " << cascadeWorkspace.lastWindows
+              << " windows, expected " << slideWorkspace.lastWindows
+              << std::endl;
+    failures++;
+  }
+  failures += compare("cascade without limit", slideResult, cascadeResult);
+  std::cout << "cascade without limit: " << cascadeWorkspace.lastWindows
+            << " windows, " << cascadeResult.bbox.size()
+            << " faces compared with slide" << std::endl;
+  for (auto &nameImage : images) {
+    auto mode = nameImage.first == "resize" ? FaceDetectionMode::RESIZE
+                                            : FaceDetectionMode::SLIDE;
+    auto expected = faceDetection(&fp32Engine, nameImage.second, mode);
+    if (expected.bbox.empty()) {
+      std::cerr << nameImage.first << ": FP32 detected no faces"
+                << std::endl;
+      failures++;
+      continue;
+    }
+    failures += compare(nameImage.first + " FP16", expected,
+                        faceDetection(&fp16Engine, nameImage.second, mode));
+    failures += compare(nameImage.first + " INT8", expected,
+                        faceDetection(&int8Engine, nameImage.second, mode));
+    failures +=
+        compare(nameImage.first + " engine batch 4", expected,
+                faceDetection(&chunkedEngine, nameImage.second, mode));
+    std::cout << nameImage.first << ": " << expected.bbox.size()
+              << " faces compared" << std::endl;
+  }
+  if (failures) {
+    std::cerr << failures << " mismatches" << std::endl;
+    return 1;
+  }
+  std::cout << "FP16, INT8 and chunked outputs match FP32" << std::endl;
+  return 0;
+}